@@ -0,0 +1,37 @@
+#ifndef AUDIO_BACKEND_H
+#define AUDIO_BACKEND_H
+
+#include "video-audio.h"
+
+// A driver that pulls mixed audio out of an audio_state.
+// Start fills in the state's SampleRate and OutputLatency, then
+// calls MixAudio once per period, from its own thread.
+struct audio_backend {
+    const char* Name;
+    bool (*Start)(audio_state* AudioState, const audio_options* Options);
+    void (*Stop)(audio_state* AudioState);
+
+    // The frame time being output right now, on the
+    // same clock as the CycleFrameTime given to MixAudio
+    uint32_t (*GetFrameTime)(audio_state* AudioState);
+};
+
+extern const audio_backend JackAudioBackend;
+extern const audio_backend NullAudioBackend;
+
+// Mixes every active channel into NumFrames of output.
+// CycleFrameTime is the backend's frame time for the first of them.
+void MixAudio(audio_state* AudioState, float* OutLeft, float* OutRight,
+    uint32_t NumFrames, uint32_t CycleFrameTime);
+
+// For the backend to report the device missing a period.
+void RecordAudioXrun(audio_state* AudioState);
+
+// Whether the mixer has any channels to play. Only call from the mixer's thread.
+bool AudioHasVoices(audio_state* AudioState);
+
+// Whether every channel the mixer plays has at least NumFrames queued,
+// false if it has none. Only call from the mixer's thread.
+bool AudioChannelsHaveFrames(audio_state* AudioState, uint32_t NumFrames);
+
+#endif // AUDIO_BACKEND_H
@@ -0,0 +1,137 @@
+#include "audio-backend.h"
+#include <jack/jack.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+typedef struct {
+    jack_client_t *Client;
+    jack_port_t *OutputPortLeft;
+    jack_port_t *OutputPortRight;
+} jack_audio;
+
+int AudioThreadCallback(
+    jack_nframes_t NumFrames, void *Arg) {
+
+    audio_state *S = (audio_state*)Arg;
+    jack_audio* Jack = S->BackendData;
+
+    MixAudio(S,
+        (float*)jack_port_get_buffer(Jack->OutputPortLeft,  NumFrames),
+        (float*)jack_port_get_buffer(Jack->OutputPortRight, NumFrames),
+        NumFrames,
+        jack_last_frame_time(Jack->Client));
+
+    return 0;
+}
+
+int XrunCallback(void *Arg) {
+    RecordAudioXrun((audio_state*)Arg);
+    return 0;
+}
+
+bool ConnectJack(audio_state* AudioState, jack_audio* Jack) {
+    const char **Ports;
+
+    Jack->OutputPortLeft = jack_port_register(Jack->Client,  "output_left",
+                      JACK_DEFAULT_AUDIO_TYPE,
+                      JackPortIsOutput|JackPortIsTerminal, 0);
+    Jack->OutputPortRight = jack_port_register(Jack->Client, "output_right",
+                      JACK_DEFAULT_AUDIO_TYPE,
+                      JackPortIsOutput|JackPortIsTerminal, 0);
+
+    if (Jack->OutputPortLeft == NULL || Jack->OutputPortRight == NULL) {
+        fprintf(stderr, "no more JACK ports available\n");
+        return false;
+    }
+
+    if (jack_activate(Jack->Client)) {
+        fprintf(stderr, "cannot activate client");
+        return false;
+    }
+
+    // "Input" here meaning we are "Inputting to JACK",
+    Ports = jack_get_ports(Jack->Client, NULL, NULL, JackPortIsPhysical|JackPortIsInput);
+    if (Ports == NULL) {
+        fprintf(stderr, "no physical playback ports\n");
+        return false;
+    }
+
+    if (jack_connect(Jack->Client, jack_port_name(Jack->OutputPortLeft), Ports[0])
+        || jack_connect(Jack->Client, jack_port_name(Jack->OutputPortRight), Ports[1])) {
+        fprintf(stderr, "cannot connect output ports\n");
+        free(Ports);
+        return false;
+    }
+
+    free(Ports);
+    return true;
+}
+
+bool StartJack(audio_state* AudioState, const audio_options* Options) {
+    const char *ClientName = "VideoAudioEngine";
+    const char *ServerName = NULL;
+    jack_options_t JackOptions = JackNullOption;
+    jack_status_t Status;
+
+    jack_audio* Jack = calloc(1, sizeof(jack_audio));
+
+    Jack->Client = jack_client_open(ClientName, JackOptions, &Status, ServerName);
+    if (Jack->Client == NULL) {
+        fprintf(stderr, "jack_client_open() failed, "
+             "status = 0x%2.0x\n", Status);
+        if (Status & JackServerFailed) {
+            fprintf(stderr, "Unable to connect to JACK server\n");
+        }
+        free(Jack);
+        return false;
+    }
+    if (Status & JackServerStarted) {
+        fprintf(stderr, "JACK server started\n");
+    }
+
+    if (Status & JackNameNotUnique) {
+        ClientName = jack_get_client_name(Jack->Client);
+        fprintf(stderr, "unique name `%s' assigned\n", ClientName);
+    }
+
+    AudioState->BackendData = Jack;
+
+    jack_set_process_callback(Jack->Client, AudioThreadCallback, (void*)AudioState);
+    jack_set_xrun_callback(Jack->Client, XrunCallback, (void*)AudioState);
+    // jack_on_shutdown(client, jack_shutdown, 0);
+
+    AudioState->SampleRate = jack_get_sample_rate(Jack->Client);
+    printf("engine sample rate: %i\n", AudioState->SampleRate);
+
+    if (!ConnectJack(AudioState, Jack)) {
+        jack_client_close(Jack->Client);
+        free(Jack);
+        AudioState->BackendData = NULL;
+        return false;
+    }
+
+    jack_latency_range_t Latency;
+    jack_port_get_latency_range(Jack->OutputPortLeft, JackPlaybackLatency, &Latency);
+    AudioState->OutputLatency = Latency.max;
+    printf("engine output latency: %" PRIu32 " frames\n", AudioState->OutputLatency);
+
+    return true;
+}
+
+void StopJack(audio_state* AudioState) {
+    jack_audio* Jack = AudioState->BackendData;
+    jack_client_close(Jack->Client);
+    free(Jack);
+}
+
+uint32_t GetJackFrameTime(audio_state* AudioState) {
+    jack_audio* Jack = AudioState->BackendData;
+    return jack_frame_time(Jack->Client);
+}
+
+const audio_backend JackAudioBackend = {
+    .Name         = "jack",
+    .Start        = StartJack,
+    .Stop         = StopJack,
+    .GetFrameTime = GetJackFrameTime
+};
@@ -0,0 +1,225 @@
+#include "audio-backend.h"
+#include "utils.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+// Drives the mixer without a sound device, for headless runs and benchmarks.
+// In timer mode it mixes a block each time the monotonic clock reaches it,
+// like a sound card would. In lockstep mode it mixes each block as soon as
+// every channel has one queued, so the whole engine runs as fast as the
+// decoders can go and the result doesn't depend on scheduling. With no
+// channels to keep step with, or once one stalls, lockstep mode keeps
+// time like timer mode until every channel has a block again.
+
+#define LOCKSTEP_POLL_SECONDS  0.0005
+#define LOCKSTEP_STALL_SECONDS 0.1 // Give up on a channel that's stopped feeding
+
+typedef struct {
+    pthread_t Thread;
+    atomic_bool Running;
+    bool Lockstep;
+    int BlockSize;
+    double StartTime;
+    atomic_uint FramesMixed; // The frame time in lockstep mode
+
+    // Where timer pacing last started from
+    bool     Pacing;
+    double   PaceStartTime;
+    uint32_t PaceStartFrame;
+
+    float* OutLeft;
+    float* OutRight;
+
+    FILE* Wav;
+    float* WavFrames; // Interleaved copy of a block
+    uint32_t WavFramesWritten;
+} null_audio;
+
+static void WriteLE(FILE* File, uint32_t Value, int Bytes) {
+    for (int Byte = 0; Byte < Bytes; Byte++) {
+        fputc((Value >> (Byte * 8)) & 0xFF, File);
+    }
+}
+
+// 32-bit float stereo. Sizes are patched in once we know them.
+static void WriteWavHeader(FILE* File, int SampleRate, uint32_t NumFrames) {
+    const int Channels = 2;
+    const int BytesPerFrame = Channels * sizeof(float);
+    const uint32_t DataSize = NumFrames * BytesPerFrame;
+
+    fseek(File, 0, SEEK_SET);
+    fwrite("RIFF", 1, 4, File);
+    WriteLE(File, 36 + DataSize, 4);
+    fwrite("WAVE", 1, 4, File);
+
+    fwrite("fmt ", 1, 4, File);
+    WriteLE(File, 16, 4);
+    WriteLE(File, 3, 2); // WAVE_FORMAT_IEEE_FLOAT
+    WriteLE(File, Channels, 2);
+    WriteLE(File, SampleRate, 4);
+    WriteLE(File, SampleRate * BytesPerFrame, 4);
+    WriteLE(File, BytesPerFrame, 2);
+    WriteLE(File, 32, 2);
+
+    fwrite("data", 1, 4, File);
+    WriteLE(File, DataSize, 4);
+}
+
+static void WriteWavBlock(null_audio* Null) {
+    for (int Frame = 0; Frame < Null->BlockSize; Frame++) {
+        Null->WavFrames[Frame * 2]     = Null->OutLeft[Frame];
+        Null->WavFrames[Frame * 2 + 1] = Null->OutRight[Frame];
+    }
+    fwrite(Null->WavFrames, sizeof(float) * 2, Null->BlockSize, Null->Wav);
+    Null->WavFramesWritten += Null->BlockSize;
+}
+
+// Returns false if a channel stalled, or the backend is stopping.
+static bool WaitForChannels(audio_state* AudioState, null_audio* Null) {
+    const double Deadline = GetTimeInSeconds() + LOCKSTEP_STALL_SECONDS;
+    while (atomic_load(&Null->Running)) {
+        if (AudioChannelsHaveFrames(AudioState, Null->BlockSize)) {
+            return true;
+        }
+        if (GetTimeInSeconds() > Deadline) {
+            return false; // Play what there is rather than hold up the others
+        }
+        SleepSeconds(LOCKSTEP_POLL_SECONDS);
+    }
+    return false;
+}
+
+// Whether lockstep mode should keep time for this block instead of
+// waiting on the channels: when there are none, or one has stalled
+// and still hasn't caught up.
+static bool ShouldPaceLockstep(audio_state* AudioState, null_audio* Null) {
+    if (!AudioHasVoices(AudioState)) {
+        return true;
+    }
+    if (Null->Pacing) {
+        return !AudioChannelsHaveFrames(AudioState, Null->BlockSize);
+    }
+    return !WaitForChannels(AudioState, Null);
+}
+
+// Sleeps until the block would start playing, like a sound card.
+static void PaceBlock(audio_state* AudioState, null_audio* Null, uint32_t CycleFrameTime) {
+    if (!Null->Pacing) {
+        Null->Pacing = true;
+        Null->PaceStartTime  = GetTimeInSeconds();
+        Null->PaceStartFrame = CycleFrameTime;
+    }
+
+    const uint32_t FramesSinceStart = CycleFrameTime - Null->PaceStartFrame;
+    double Deadline = Null->PaceStartTime + (double)FramesSinceStart / AudioState->SampleRate;
+    double Remaining = Deadline - GetTimeInSeconds();
+    if (Remaining > 0) {
+        SleepSeconds(Remaining);
+    } else if (!Null->Lockstep &&
+               -Remaining > (double)Null->BlockSize / AudioState->SampleRate) {
+        // A sound card would have played this block before we mixed it
+        RecordAudioXrun(AudioState);
+    }
+}
+
+static void* NullAudioThreadMain(void* Arg) {
+    audio_state* AudioState = Arg;
+    null_audio* Null = AudioState->BackendData;
+
+    while (atomic_load(&Null->Running)) {
+        const uint32_t CycleFrameTime = atomic_load(&Null->FramesMixed);
+
+        if (!Null->Lockstep || ShouldPaceLockstep(AudioState, Null)) {
+            PaceBlock(AudioState, Null, CycleFrameTime);
+        } else {
+            Null->Pacing = false;
+        }
+
+        MixAudio(AudioState, Null->OutLeft, Null->OutRight, Null->BlockSize, CycleFrameTime);
+
+        if (Null->Wav) {
+            WriteWavBlock(Null);
+        }
+
+        atomic_store(&Null->FramesMixed, CycleFrameTime + Null->BlockSize);
+    }
+
+    return NULL;
+}
+
+static void FreeNullAudio(null_audio* Null) {
+    free(Null->OutLeft);
+    free(Null->OutRight);
+    free(Null->WavFrames);
+    free(Null);
+}
+
+bool StartNullAudio(audio_state* AudioState, const audio_options* Options) {
+    null_audio* Null = calloc(1, sizeof(null_audio));
+    Null->Lockstep  = Options->Lockstep;
+    Null->BlockSize = Options->BlockSize;
+    Null->OutLeft   = calloc(Null->BlockSize, sizeof(float));
+    Null->OutRight  = calloc(Null->BlockSize, sizeof(float));
+
+    AudioState->SampleRate    = Options->SampleRate;
+    AudioState->OutputLatency = 0; // A block is "heard" as it's mixed
+
+    if (Options->WavPath) {
+        Null->Wav = fopen(Options->WavPath, "wb");
+        if (!Null->Wav) {
+            fprintf(stderr, "Couldn't open %s for writing\n", Options->WavPath);
+            FreeNullAudio(Null);
+            return false;
+        }
+        Null->WavFrames = calloc(Null->BlockSize, sizeof(float) * 2);
+        WriteWavHeader(Null->Wav, AudioState->SampleRate, 0);
+    }
+
+    printf("null audio: %i Hz, %i frame blocks, %s\n",
+        AudioState->SampleRate, Null->BlockSize,
+        Null->Lockstep ? "lockstep" : "realtime");
+
+    AudioState->BackendData = Null;
+    atomic_init(&Null->FramesMixed, 0);
+    atomic_init(&Null->Running, true);
+    Null->StartTime = GetTimeInSeconds();
+    Null->Pacing         = true;
+    Null->PaceStartTime  = Null->StartTime;
+    Null->PaceStartFrame = 0;
+    pthread_create(&Null->Thread, NULL, NullAudioThreadMain, AudioState);
+
+    return true;
+}
+
+void StopNullAudio(audio_state* AudioState) {
+    null_audio* Null = AudioState->BackendData;
+
+    atomic_store(&Null->Running, false);
+    pthread_join(Null->Thread, NULL);
+
+    if (Null->Wav) {
+        WriteWavHeader(Null->Wav, AudioState->SampleRate, Null->WavFramesWritten);
+        fclose(Null->Wav);
+        printf("null audio: wrote %.2fs of audio\n",
+            (double)Null->WavFramesWritten / AudioState->SampleRate);
+    }
+
+    FreeNullAudio(Null);
+}
+
+uint32_t GetNullFrameTime(audio_state* AudioState) {
+    null_audio* Null = AudioState->BackendData;
+    if (Null->Lockstep) {
+        return atomic_load(&Null->FramesMixed);
+    }
+    // Wraps like a JACK frame time would
+    return (uint32_t)(uint64_t)((GetTimeInSeconds() - Null->StartTime) * AudioState->SampleRate);
+}
+
+const audio_backend NullAudioBackend = {
+    .Name         = "null",
+    .Start        = StartNullAudio,
+    .Stop         = StopNullAudio,
+    .GetFrameTime = GetNullFrameTime
+};
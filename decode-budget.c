@@ -0,0 +1,96 @@
+#include "decode-budget.h"
+#include "utils.h"
+#include <pthread.h>
+#include <unistd.h>
+
+// Entropy decoding dominates at high bitrates,
+// so each bit costs about as much as a few pixels.
+#define PIXELS_PER_BIT 4.0
+
+static pthread_mutex_t BudgetMutex = PTHREAD_MUTEX_INITIALIZER;
+static decode_budget_entry* BudgetEntries = NULL;
+
+static int GetCoreCount() {
+    long Cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return Cores > 0 ? (int)Cores : 1;
+}
+
+double GetDecodeWeight(int Width, int Height, double FramesPerSecond, int64_t BitRate) {
+    if (FramesPerSecond <= 0) {
+        FramesPerSecond = 30;
+    }
+    double PixelsPerSecond = (double)Width * Height * FramesPerSecond;
+    return PixelsPerSecond + PIXELS_PER_BIT * (double)MAX(BitRate, 0);
+}
+
+// Must be called with BudgetMutex held
+static void RebalanceDecodeBudget() {
+    double TotalWeight = 0;
+    int NumEntries = 0;
+    for (decode_budget_entry* Entry = BudgetEntries; Entry; Entry = Entry->Next) {
+        TotalWeight += Entry->Weight;
+        NumEntries++;
+    }
+
+    // Every decoder needs its one thread, so past one video per core
+    // that's all each of them gets
+    const int Cores = GetCoreCount();
+    int Spare = Cores - NumEntries;
+    for (decode_budget_entry* Entry = BudgetEntries; Entry; Entry = Entry->Next) {
+        Entry->AssignedThreads = 1;
+    }
+
+    // Hand out the rest one at a time to whichever decoder is furthest
+    // below its share, so the total never goes over the core count
+    for (; Spare > 0; Spare--) {
+        decode_budget_entry* Neediest = NULL;
+        double MostNeeded = 0;
+        for (decode_budget_entry* Entry = BudgetEntries; Entry; Entry = Entry->Next) {
+            int Threads = Entry->AssignedThreads;
+            if (Threads >= MAX_DECODER_THREADS) continue;
+            double Share = TotalWeight > 0 ? Entry->Weight / TotalWeight : 1.0 / NumEntries;
+            double Needed = Cores * Share - Threads;
+            if (!Neediest || Needed > MostNeeded) {
+                Neediest = Entry;
+                MostNeeded = Needed;
+            }
+        }
+        if (!Neediest) break;
+        Neediest->AssignedThreads++;
+    }
+
+    for (decode_budget_entry* Entry = BudgetEntries; Entry; Entry = Entry->Next) {
+        atomic_store(&Entry->ThreadCount, Entry->AssignedThreads);
+    }
+}
+
+void RegisterDecodeBudget(decode_budget_entry* Entry, double Weight) {
+    pthread_mutex_lock(&BudgetMutex);
+    Entry->Weight = Weight;
+    Entry->Registered = true;
+    Entry->Next = BudgetEntries;
+    BudgetEntries = Entry;
+    RebalanceDecodeBudget();
+    pthread_mutex_unlock(&BudgetMutex);
+}
+
+void UnregisterDecodeBudget(decode_budget_entry* Entry) {
+    if (!Entry->Registered) return;
+
+    pthread_mutex_lock(&BudgetMutex);
+    decode_budget_entry** Link = &BudgetEntries;
+    while (*Link && *Link != Entry) {
+        Link = &(*Link)->Next;
+    }
+    if (*Link) {
+        *Link = Entry->Next;
+    }
+    Entry->Next = NULL;
+    Entry->Registered = false;
+    RebalanceDecodeBudget();
+    pthread_mutex_unlock(&BudgetMutex);
+}
+
+int GetDecodeBudgetThreads(decode_budget_entry* Entry) {
+    return atomic_load(&Entry->ThreadCount);
+}
@@ -0,0 +1,35 @@
+#ifndef DECODE_BUDGET_H
+#define DECODE_BUDGET_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Shares a fixed number of decoder threads (one per core)
+// between every open video decoder, in proportion to how much
+// work each one does per second. Each decoder gets at least
+// one, so with more decoders than cores each gets just one.
+
+// FFmpeg advises against more than 16 threads per decoder
+#define MAX_DECODER_THREADS 16
+
+typedef struct decode_budget_entry {
+    double Weight;
+    atomic_int ThreadCount; // Updated whenever the budget is rebalanced
+    int AssignedThreads;    // Worked out under the budget's lock
+    bool Registered;
+    struct decode_budget_entry* Next;
+} decode_budget_entry;
+
+// Estimates decoding cost from pixels per second and bits per second.
+double GetDecodeWeight(int Width, int Height, double FramesPerSecond, int64_t BitRate);
+
+// Adds an entry and rebalances every entry's ThreadCount.
+void RegisterDecodeBudget(decode_budget_entry* Entry, double Weight);
+
+// Removes an entry and hands its threads to the others.
+void UnregisterDecodeBudget(decode_budget_entry* Entry);
+
+int GetDecodeBudgetThreads(decode_budget_entry* Entry);
+
+#endif // DECODE_BUDGET_H
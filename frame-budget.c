@@ -0,0 +1,121 @@
+#include "frame-budget.h"
+#include "utils.h"
+#include <pthread.h>
+#include <stdio.h>
+
+static pthread_mutex_t BudgetMutex = PTHREAD_MUTEX_INITIALIZER;
+static frame_budget_entry* BudgetEntries = NULL;
+
+static int64_t TotalBudgetBytes    = FRAME_BUDGET_TOTAL_BYTES;
+static int64_t PerVideoBudgetBytes = FRAME_BUDGET_PER_VIDEO_BYTES;
+static double  BufferSeconds       = FRAME_BUFFER_SECONDS;
+
+// How many frames the entry would like, ignoring everyone else
+static int GetWantedDepth(frame_budget_entry* Entry) {
+    int ForTime  = (int)(Entry->FramesPerSecond * BufferSeconds + 0.5);
+    int ForBytes = (int)(PerVideoBudgetBytes / Entry->FrameBytes);
+    return CLAMP(MIN_BUFFERED_FRAMES, Entry->MaxDepth, MIN(ForTime, ForBytes));
+}
+
+// Must be called with BudgetMutex held
+static void RebalanceFrameBudget() {
+    int64_t WantedBytes = 0;
+    for (frame_budget_entry* Entry = BudgetEntries; Entry; Entry = Entry->Next) {
+        WantedBytes += GetWantedDepth(Entry) * Entry->FrameBytes;
+    }
+
+    // Everyone gives up the same share of their depth when over budget
+    double Scale = 1;
+    if (WantedBytes > TotalBudgetBytes) {
+        Scale = (double)TotalBudgetBytes / WantedBytes;
+    }
+
+    for (frame_budget_entry* Entry = BudgetEntries; Entry; Entry = Entry->Next) {
+        int Depth = (int)(GetWantedDepth(Entry) * Scale);
+        atomic_store(&Entry->Depth, CLAMP(MIN_BUFFERED_FRAMES, Entry->MaxDepth, Depth));
+    }
+}
+
+void SetFrameBudget(int64_t TotalBytes, int64_t BytesPerVideo, double Seconds) {
+    pthread_mutex_lock(&BudgetMutex);
+    if (TotalBytes > 0)    TotalBudgetBytes    = TotalBytes;
+    if (BytesPerVideo > 0) PerVideoBudgetBytes = BytesPerVideo;
+    if (Seconds > 0)       BufferSeconds       = Seconds;
+    RebalanceFrameBudget();
+    pthread_mutex_unlock(&BudgetMutex);
+}
+
+void RegisterFrameBudget(frame_budget_entry* Entry,
+    int64_t FrameBytes, double FramesPerSecond, int MaxDepth) {
+
+    pthread_mutex_lock(&BudgetMutex);
+    Entry->FrameBytes      = MAX(FrameBytes, 1);
+    Entry->FramesPerSecond = FramesPerSecond > 0 ? FramesPerSecond : 30;
+    Entry->MaxDepth        = MAX(MaxDepth, MIN_BUFFERED_FRAMES);
+    atomic_store(&Entry->Buffered, 0);
+    Entry->Registered = true;
+    Entry->Next = BudgetEntries;
+    BudgetEntries = Entry;
+    RebalanceFrameBudget();
+    pthread_mutex_unlock(&BudgetMutex);
+}
+
+void UnregisterFrameBudget(frame_budget_entry* Entry) {
+    if (!Entry->Registered) return;
+
+    pthread_mutex_lock(&BudgetMutex);
+    frame_budget_entry** Link = &BudgetEntries;
+    while (*Link && *Link != Entry) {
+        Link = &(*Link)->Next;
+    }
+    if (*Link) {
+        *Link = Entry->Next;
+    }
+    Entry->Next = NULL;
+    Entry->Registered = false;
+    RebalanceFrameBudget();
+    pthread_mutex_unlock(&BudgetMutex);
+}
+
+void SetFrameBudgetFrameBytes(frame_budget_entry* Entry, int64_t FrameBytes) {
+    if (!Entry->Registered) return;
+
+    pthread_mutex_lock(&BudgetMutex);
+    Entry->FrameBytes = MAX(FrameBytes, 1);
+    RebalanceFrameBudget();
+    pthread_mutex_unlock(&BudgetMutex);
+}
+
+int GetFrameBudgetDepth(frame_budget_entry* Entry) {
+    return atomic_load(&Entry->Depth);
+}
+
+void SetFrameBudgetBuffered(frame_budget_entry* Entry, int Frames) {
+    atomic_store_explicit(&Entry->Buffered, Frames, memory_order_relaxed);
+}
+
+void GetFrameBudgetStats(frame_budget_stats* Stats) {
+    *Stats = (frame_budget_stats){0};
+
+    pthread_mutex_lock(&BudgetMutex);
+    Stats->TotalBytes = TotalBudgetBytes;
+    for (frame_budget_entry* Entry = BudgetEntries; Entry; Entry = Entry->Next) {
+        Stats->Videos++;
+        Stats->BudgetedBytes += atomic_load(&Entry->Depth) * Entry->FrameBytes;
+        Stats->BufferedBytes += atomic_load_explicit(&Entry->Buffered, memory_order_relaxed) *
+            Entry->FrameBytes;
+    }
+    pthread_mutex_unlock(&BudgetMutex);
+}
+
+void PrintFrameBudget() {
+    frame_budget_stats Stats;
+    GetFrameBudgetStats(&Stats);
+
+    const double MB = 1024.0 * 1024.0;
+    printf("Frame budget: %i videos, %.1fMB budgeted of %.1fMB, %.1fMB buffered\n",
+        Stats.Videos,
+        Stats.BudgetedBytes / MB,
+        Stats.TotalBytes / MB,
+        Stats.BufferedBytes / MB);
+}
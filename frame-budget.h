@@ -0,0 +1,60 @@
+#ifndef FRAME_BUDGET_H
+#define FRAME_BUDGET_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Decides how many decoded frames each video buffers ahead.
+// Each video keeps about FRAME_BUFFER_SECONDS worth, capped by a
+// per-video byte budget, and if that would take every video past
+// the global byte budget, all of them are scaled back alike.
+
+#define FRAME_BUFFER_SECONDS 0.5
+#define FRAME_BUDGET_PER_VIDEO_BYTES (256ll << 20)
+#define FRAME_BUDGET_TOTAL_BYTES     (1024ll << 20)
+
+// Fewest frames a video buffers, whatever the budget
+#define MIN_BUFFERED_FRAMES 3
+
+typedef struct frame_budget_entry {
+    int64_t FrameBytes;
+    double FramesPerSecond;
+    int MaxDepth;
+    atomic_int Depth;    // Updated whenever the budget is rebalanced
+    atomic_int Buffered; // Reported by the decode thread
+    bool Registered;
+    struct frame_budget_entry* Next;
+} frame_budget_entry;
+
+typedef struct {
+    int Videos;
+    int64_t TotalBytes;     // The global budget
+    int64_t BudgetedBytes;  // What every video's depth adds up to
+    int64_t BufferedBytes;  // What's decoded and waiting right now
+} frame_budget_stats;
+
+// Any of these left zero keeps its default. Rebalances.
+void SetFrameBudget(int64_t TotalBytes, int64_t BytesPerVideo, double Seconds);
+
+// Adds an entry and rebalances every entry's Depth.
+// MaxDepth is the most its queue can hold.
+void RegisterFrameBudget(frame_budget_entry* Entry,
+    int64_t FrameBytes, double FramesPerSecond, int MaxDepth);
+
+// Removes an entry and hands its bytes to the others.
+void UnregisterFrameBudget(frame_budget_entry* Entry);
+
+// For when the entry's frames change size, e.g. its decoder reopening
+// at another lowres. Rebalances.
+void SetFrameBudgetFrameBytes(frame_budget_entry* Entry, int64_t FrameBytes);
+
+int GetFrameBudgetDepth(frame_budget_entry* Entry);
+
+void SetFrameBudgetBuffered(frame_budget_entry* Entry, int Frames);
+
+void GetFrameBudgetStats(frame_budget_stats* Stats);
+
+void PrintFrameBudget();
+
+#endif // FRAME_BUDGET_H
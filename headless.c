@@ -0,0 +1,143 @@
+#include "headless.h"
+#include <EGL/eglext.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "quad.h"
+#include "utils.h"
+
+static bool HasEGLExtension(EGLDisplay Display, const char* Name) {
+    const char* Extensions = eglQueryString(Display, EGL_EXTENSIONS);
+    return Extensions && strstr(Extensions, Name);
+}
+
+static EGLDisplay GetHeadlessDisplay() {
+    EGLDisplay Display = EGL_NO_DISPLAY;
+
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+    // Needs no X server and no GPU device node
+    PFNEGLGETPLATFORMDISPLAYEXTPROC GetPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (GetPlatformDisplay) {
+        Display = GetPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    }
+#endif
+
+    if (Display == EGL_NO_DISPLAY) {
+        Display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    }
+    return Display;
+}
+
+static void CreateHeadlessFramebuffer(headless* Headless) {
+    glGenRenderbuffers(1, &Headless->ColorRenderbuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, Headless->ColorRenderbuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, Headless->Width, Headless->Height);
+
+    glGenFramebuffers(1, &Headless->Framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, Headless->Framebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+        GL_RENDERBUFFER, Headless->ColorRenderbuffer);
+
+    GLenum Status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (Status != GL_FRAMEBUFFER_COMPLETE) {
+        Fatal("Headless framebuffer incomplete: 0x%X\n", Status);
+    }
+
+    glViewport(0, 0, Headless->Width, Headless->Height);
+}
+
+headless* CreateHeadlessContext(int Width, int Height) {
+    headless* Headless = calloc(1, sizeof(headless));
+    Headless->Width   = Width;
+    Headless->Height  = Height;
+    Headless->Surface = EGL_NO_SURFACE;
+
+    Headless->Display = GetHeadlessDisplay();
+    if (Headless->Display == EGL_NO_DISPLAY) {
+        Fatal("Couldn't get an EGL display\n");
+    }
+
+    EGLint Major, Minor;
+    if (!eglInitialize(Headless->Display, &Major, &Minor)) {
+        Fatal("Couldn't initialize EGL: 0x%X\n", eglGetError());
+    }
+    printf("EGL %i.%i (%s)\n", Major, Minor,
+        eglQueryString(Headless->Display, EGL_VENDOR));
+
+    // We draw into our own FBO, so only fall back
+    // to a pbuffer when we can't go surfaceless.
+    bool Surfaceless = HasEGLExtension(Headless->Display, "EGL_KHR_surfaceless_context");
+
+    const EGLint ConfigAttribs[] = {
+        EGL_SURFACE_TYPE,    Surfaceless ? 0 : EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE,        8,
+        EGL_GREEN_SIZE,      8,
+        EGL_BLUE_SIZE,       8,
+        EGL_NONE
+    };
+    EGLConfig Config;
+    EGLint NumConfigs = 0;
+    if (!eglChooseConfig(Headless->Display, ConfigAttribs, &Config, 1, &NumConfigs)
+        || NumConfigs == 0) {
+        Fatal("No EGL config for desktop OpenGL\n");
+    }
+
+    if (!eglBindAPI(EGL_OPENGL_API)) {
+        Fatal("EGL can't bind desktop OpenGL\n");
+    }
+
+    const EGLint ContextAttribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION,       4,
+        EGL_CONTEXT_MINOR_VERSION,       1,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_CONTEXT_OPENGL_FORWARD_COMPATIBLE, EGL_TRUE,
+        EGL_NONE
+    };
+    Headless->Context = eglCreateContext(Headless->Display, Config,
+        EGL_NO_CONTEXT, ContextAttribs);
+    if (Headless->Context == EGL_NO_CONTEXT) {
+        Fatal("Couldn't create a GL 4.1 core context: 0x%X\n", eglGetError());
+    }
+
+    if (!Surfaceless) {
+        const EGLint SurfaceAttribs[] = {
+            EGL_WIDTH,  1,
+            EGL_HEIGHT, 1,
+            EGL_NONE
+        };
+        Headless->Surface = eglCreatePbufferSurface(Headless->Display, Config, SurfaceAttribs);
+        if (Headless->Surface == EGL_NO_SURFACE) {
+            Fatal("Couldn't create a pbuffer: 0x%X\n", eglGetError());
+        }
+    }
+
+    if (!eglMakeCurrent(Headless->Display,
+        Headless->Surface, Headless->Surface, Headless->Context)) {
+        Fatal("Couldn't make the headless context current: 0x%X\n", eglGetError());
+    }
+
+    InitGLEW();
+    printf("Headless renderer: %s\n", glGetString(GL_RENDERER));
+
+    CreateHeadlessFramebuffer(Headless);
+
+    return Headless;
+}
+
+void FreeHeadlessContext(headless* Headless) {
+    if (!Headless) return;
+
+    glDeleteFramebuffers(1, &Headless->Framebuffer);
+    glDeleteRenderbuffers(1, &Headless->ColorRenderbuffer);
+
+    eglMakeCurrent(Headless->Display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (Headless->Surface != EGL_NO_SURFACE) {
+        eglDestroySurface(Headless->Display, Headless->Surface);
+    }
+    eglDestroyContext(Headless->Display, Headless->Context);
+    eglTerminate(Headless->Display);
+    free(Headless);
+}
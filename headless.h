@@ -0,0 +1,26 @@
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+#include <GL/glew.h>
+#include <EGL/egl.h>
+
+// An offscreen GL 4.1 core context for running without a display.
+// Uses a surfaceless EGL display where available (Mesa's llvmpipe works),
+// falling back to a pbuffer, and renders into an FBO of the given size.
+typedef struct {
+    EGLDisplay Display;
+    EGLContext Context;
+    EGLSurface Surface;
+    GLuint Framebuffer;
+    GLuint ColorRenderbuffer;
+    int Width;
+    int Height;
+} headless;
+
+// Creates the context, makes it current, initializes GLEW
+// and leaves the FBO bound with a matching viewport.
+headless* CreateHeadlessContext(int Width, int Height);
+
+void FreeHeadlessContext(headless* Headless);
+
+#endif // HEADLESS_H
@@ -0,0 +1,144 @@
+#include "keyframe-index.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Must be called with the index's Mutex held
+static void AddKeyframe(keyframe_index* Index, int64_t Timestamp) {
+    // Keyframes come in decode order, which only goes backwards in
+    // broken files, so keep the list sorted with a short insertion
+    int Slot = Index->Count;
+    if (Slot > 0 && Index->Timestamps[Slot - 1] == Timestamp) {
+        return;
+    }
+    if (Index->Count == Index->Capacity) {
+        Index->Capacity = Index->Capacity ? Index->Capacity * 2 : 256;
+        Index->Timestamps = realloc(Index->Timestamps,
+            Index->Capacity * sizeof(int64_t));
+    }
+    while (Slot > 0 && Index->Timestamps[Slot - 1] > Timestamp) {
+        Index->Timestamps[Slot] = Index->Timestamps[Slot - 1];
+        Slot--;
+    }
+    Index->Timestamps[Slot] = Timestamp;
+    Index->Count++;
+}
+
+// Containers with their own index (mp4, mov, mkv with cues) already
+// seek to the right keyframe with AVSEEK_FLAG_BACKWARD
+static bool HasContainerIndex(AVStream* Stream) {
+    int NumEntries = avformat_index_get_entries_count(Stream);
+    for (int EntryIndex = 0; EntryIndex < NumEntries; EntryIndex++) {
+        const AVIndexEntry* Entry = avformat_index_get_entry(Stream, EntryIndex);
+        if (Entry->flags & AVINDEX_KEYFRAME) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void ScanKeyframes(keyframe_index* Index, AVFormatContext* FormatContext) {
+    AVPacket* Packet = av_packet_alloc();
+
+    while (!atomic_load(&Index->Stop) && av_read_frame(FormatContext, Packet) >= 0) {
+        if (Packet->stream_index == Index->StreamIndex) {
+            // Seek targets are presentation times. A keyframe's decode
+            // time can be well before it's shown, so one without a pts
+            // isn't indexed at all rather than risk landing after a target.
+            int64_t Timestamp = Packet->pts != AV_NOPTS_VALUE ? Packet->pts : Packet->dts;
+            if (Timestamp != AV_NOPTS_VALUE) {
+                pthread_mutex_lock(&Index->Mutex);
+                if ((Packet->flags & AV_PKT_FLAG_KEY) && Packet->pts != AV_NOPTS_VALUE) {
+                    AddKeyframe(Index, Packet->pts);
+                }
+                Index->Reached = MAX(Index->Reached, Timestamp);
+                pthread_mutex_unlock(&Index->Mutex);
+            }
+        }
+        av_packet_unref(Packet);
+    }
+
+    if (!atomic_load(&Index->Stop)) {
+        // Reached the end of the file
+        pthread_mutex_lock(&Index->Mutex);
+        Index->Reached = INT64_MAX;
+        pthread_mutex_unlock(&Index->Mutex);
+    }
+    av_packet_free(&Packet);
+}
+
+static void* KeyframeIndexThreadMain(void* Arg) {
+    keyframe_index* Index = Arg;
+
+    AVFormatContext* FormatContext = NULL;
+    if (avformat_open_input(&FormatContext, Index->Filename, NULL, NULL) < 0) {
+        return NULL;
+    }
+
+    if (Index->StreamIndex < FormatContext->nb_streams) {
+        // Only the one stream's packets are worth reading
+        for (int StreamIndex = 0; StreamIndex < FormatContext->nb_streams; StreamIndex++) {
+            if (StreamIndex != Index->StreamIndex) {
+                FormatContext->streams[StreamIndex]->discard = AVDISCARD_ALL;
+            }
+        }
+
+        // With a container index the demuxer's own seek is already exact,
+        // so the index stays empty and never answers
+        AVStream* Stream = FormatContext->streams[Index->StreamIndex];
+        if (!HasContainerIndex(Stream)) {
+            ScanKeyframes(Index, FormatContext);
+        }
+    }
+
+    avformat_close_input(&FormatContext);
+    return NULL;
+}
+
+void StartKeyframeIndex(keyframe_index* Index, const char* Filename, int StreamIndex) {
+    memset(Index, 0, sizeof(keyframe_index));
+    pthread_mutex_init(&Index->Mutex, NULL);
+    Index->Filename    = strdup(Filename);
+    Index->StreamIndex = StreamIndex;
+    Index->Reached     = INT64_MIN;
+    atomic_init(&Index->Stop, false);
+
+    pthread_create(&Index->Thread, NULL, KeyframeIndexThreadMain, Index);
+}
+
+void FreeKeyframeIndex(keyframe_index* Index) {
+    if (!Index->Filename) return;
+
+    atomic_store(&Index->Stop, true);
+    pthread_join(Index->Thread, NULL);
+
+    pthread_mutex_destroy(&Index->Mutex);
+    free(Index->Timestamps);
+    free(Index->Filename);
+    Index->Filename = NULL;
+}
+
+bool FindKeyframe(keyframe_index* Index, int64_t Target, int64_t* Keyframe) {
+    if (!Index->Filename) return false;
+
+    pthread_mutex_lock(&Index->Mutex);
+    bool Found = false;
+    if (Target <= Index->Reached && Index->Count > 0 && Index->Timestamps[0] <= Target) {
+        // Binary search for the last keyframe at or before Target
+        int Low  = 0;
+        int High = Index->Count - 1;
+        while (Low < High) {
+            int Mid = (Low + High + 1) / 2;
+            if (Index->Timestamps[Mid] <= Target) {
+                Low = Mid;
+            } else {
+                High = Mid - 1;
+            }
+        }
+        *Keyframe = Index->Timestamps[Low];
+        Found = true;
+    }
+    pthread_mutex_unlock(&Index->Mutex);
+
+    return Found;
+}
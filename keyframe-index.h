@@ -0,0 +1,38 @@
+#ifndef KEYFRAME_INDEX_H
+#define KEYFRAME_INDEX_H
+
+#include <libavformat/avformat.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// Where a stream's keyframes are shown, found on a background thread
+// with its own handle on the file so it never moves the demuxer.
+// Only containers without an index of their own are scanned, packet
+// by packet; the demuxer already seeks the others accurately.
+
+typedef struct {
+    pthread_t Thread;
+    pthread_mutex_t Mutex;
+    char* Filename;
+    int StreamIndex;
+
+    int64_t* Timestamps; // Keyframe pts in the stream's time base, ascending
+    int Count;
+    int Capacity;
+    int64_t Reached;     // Everything before this has been looked at
+
+    atomic_bool Stop;
+} keyframe_index;
+
+// Starts indexing the stream in the background.
+void StartKeyframeIndex(keyframe_index* Index, const char* Filename, int StreamIndex);
+
+void FreeKeyframeIndex(keyframe_index* Index);
+
+// Finds the last keyframe at or before Target.
+// Returns false if the index doesn't reach that far yet, or the
+// container has an index of its own.
+bool FindKeyframe(keyframe_index* Index, int64_t Target, int64_t* Keyframe);
+
+#endif // KEYFRAME_INDEX_H
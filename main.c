@@ -1,64 +1,140 @@
 #include <SDL.h>
 #include <GL/glew.h>
 #include <stdbool.h>
+#include <string.h>
 #include "shader.h"
 #include "quad.h"
 #include "utils.h"
 #include "video-audio.h"
 #include "video.h"
-#define NANOVG_GL3_IMPLEMENTATION
-#include "nanovg_gl.h"
+#include "wall.h"
+#include "render-scheduler.h"
+#ifdef HEADLESS_SUPPORTED
+#include "headless.h"
+#endif
 
 
-typedef struct {
-    video* Video;
-    GLuint Quad;
-} video_quad;
-
-void DrawVideo(video_quad* VideoQuad, GLuint QuadProgram)
+int main(int argc, char const *argv[])
 {
-    if (!VideoQuad || !VideoQuad->Video) return;
-
-    glUniform1i(glGetUniformLocation(QuadProgram, "uTex"), 0);
-
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, VideoQuad->Video->Texture);
+    // --headless [frames] renders offscreen and prints timings,
+    // for benchmarking on machines without a display
+    // --vsync swaps on refreshes rather than as soon as a frame is drawn
+    // --audio jack|null|none picks where audio goes, headless defaults to null
+    // --wav PATH records what the null backend mixes
+    // --lockstep runs the null backend as fast as the decoders keep up
+    // --voices N caps how many videos are heard at once
+    // --solo N mutes every video but the Nth, so only it decodes audio
+    // --frame-budget MB caps decoded frames buffered across all videos
+    // --buffer-ms MS is how far ahead each video decodes, budget allowing
+    // --loop START END loops every video between two times in seconds
+    // --clip-cache MB keeps clips that fit whole on the GPU, 0 to turn it off
+    bool Headless = false;
+    bool VSync = false;
+    int HeadlessFrames = 600;
+    const char* AudioBackendName = NULL;
+    audio_options AudioOptions = {0};
+    int SoloVideo = -1;
+    int64_t FrameBudgetBytes = 0;
+    double BufferSeconds = 0;
+    double LoopStart = 0;
+    double LoopEnd = 0;
+    size_t ClipCacheBytes = WALL_CACHE_BUDGET_BYTES;
+    for (int ArgIndex = 1; ArgIndex < argc; ArgIndex++) {
+        if (!strcmp(argv[ArgIndex], "--headless")) {
+            Headless = true;
+            if (ArgIndex + 1 < argc && atoi(argv[ArgIndex + 1]) > 0) {
+                HeadlessFrames = atoi(argv[++ArgIndex]);
+            }
+        } else if (!strcmp(argv[ArgIndex], "--vsync")) {
+            VSync = true;
+        } else if (!strcmp(argv[ArgIndex], "--audio") && ArgIndex + 1 < argc) {
+            AudioBackendName = argv[++ArgIndex];
+        } else if (!strcmp(argv[ArgIndex], "--wav") && ArgIndex + 1 < argc) {
+            AudioOptions.WavPath = argv[++ArgIndex];
+        } else if (!strcmp(argv[ArgIndex], "--lockstep")) {
+            AudioOptions.Lockstep = true;
+        } else if (!strcmp(argv[ArgIndex], "--voices") && ArgIndex + 1 < argc) {
+            AudioOptions.MaxVoices = atoi(argv[++ArgIndex]);
+        } else if (!strcmp(argv[ArgIndex], "--solo") && ArgIndex + 1 < argc) {
+            SoloVideo = atoi(argv[++ArgIndex]);
+        } else if (!strcmp(argv[ArgIndex], "--frame-budget") && ArgIndex + 1 < argc) {
+            FrameBudgetBytes = (int64_t)atoi(argv[++ArgIndex]) << 20;
+        } else if (!strcmp(argv[ArgIndex], "--buffer-ms") && ArgIndex + 1 < argc) {
+            BufferSeconds = atoi(argv[++ArgIndex]) / 1000.0;
+        } else if (!strcmp(argv[ArgIndex], "--loop") && ArgIndex + 2 < argc) {
+            LoopStart = atof(argv[++ArgIndex]);
+            LoopEnd   = atof(argv[++ArgIndex]);
+        } else if (!strcmp(argv[ArgIndex], "--clip-cache") && ArgIndex + 1 < argc) {
+            ClipCacheBytes = (size_t)atoi(argv[++ArgIndex]) << 20;
+        }
+    }
+    if (!AudioBackendName) {
+        AudioBackendName = Headless ? "null" : "jack";
+    }
 
-    glBindVertexArray(VideoQuad->Quad);
-    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-}
+    av_register_all();
 
+    SetFrameBudget(FrameBudgetBytes, 0, BufferSeconds);
 
-int main(int argc, char const *argv[])
-{
-    av_register_all();
+    audio_state* AudioState = NULL;
+    if (!strcmp(AudioBackendName, "jack")) {
+        AudioOptions.Backend = AUDIO_BACKEND_JACK;
+        AudioState = StartAudio(&AudioOptions);
+    } else if (!strcmp(AudioBackendName, "null")) {
+        AudioOptions.Backend = AUDIO_BACKEND_NULL;
+        AudioState = StartAudio(&AudioOptions);
+    } else if (strcmp(AudioBackendName, "none")) {
+        Fatal("Unknown audio backend %s\n", AudioBackendName);
+    }
+    if (!AudioState) {
+        printf("No audio engine, playing silently\n");
+    }
 
-    audio_state* AudioState = StartAudio();
+    const int WindowWidth  = 1024;
+    const int WindowHeight = 1024;
+    SDL_Window* Window = NULL;
+    SDL_GLContext GLContext = NULL;
+#ifdef HEADLESS_SUPPORTED
+    headless* HeadlessContext = NULL;
+#endif
 
-    SDL_Init(SDL_INIT_VIDEO);
+    if (Headless) {
+#ifdef HEADLESS_SUPPORTED
+        HeadlessContext = CreateHeadlessContext(WindowWidth, WindowHeight);
+#else
+        Fatal("This build has no headless support\n");
+#endif
+    } else {
+        SDL_Init(SDL_INIT_VIDEO);
 
-    SDL_GL_SetAttribute(SDL_GL_MULTISAMPLEBUFFERS, 1);
-    SDL_GL_SetAttribute(SDL_GL_MULTISAMPLESAMPLES, 8);
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_FLAGS, SDL_GL_CONTEXT_FORWARD_COMPATIBLE_FLAG);
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 4);
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 1);
-    SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+        SDL_GL_SetAttribute(SDL_GL_MULTISAMPLEBUFFERS, 1);
+        SDL_GL_SetAttribute(SDL_GL_MULTISAMPLESAMPLES, 8);
+        SDL_GL_SetAttribute(SDL_GL_CONTEXT_FLAGS, SDL_GL_CONTEXT_FORWARD_COMPATIBLE_FLAG);
+        SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 4);
+        SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 1);
+        SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
 
+        Window = SDL_CreateWindow("Veil", 10,10, WindowWidth,WindowHeight, SDL_WINDOW_OPENGL);
+        GLContext = SDL_GL_CreateContext(Window);
+        SDL_GL_MakeCurrent(Window, GLContext);
+        InitGLEW();
+    }
 
-    SDL_Window* Window = SDL_CreateWindow("Veil", 10,10, 1024,1024, SDL_WINDOW_OPENGL);
-    SDL_GLContext GLContext = SDL_GL_CreateContext(Window);
-    SDL_GL_MakeCurrent(Window, GLContext);
-    SDL_GL_SetSwapInterval(0);
-    InitGLEW();
+    render_scheduler Scheduler;
+    if (Headless) {
+        InitRenderScheduler(&Scheduler, false, 0);
+    } else {
+        SDL_GL_SetSwapInterval(VSync ? 1 : 0);
+        SDL_DisplayMode DisplayMode = {0};
+        SDL_GetWindowDisplayMode(Window, &DisplayMode);
+        InitRenderScheduler(&Scheduler, SDL_GL_GetSwapInterval() != 0, DisplayMode.refresh_rate);
+    }
 
     GLuint QuadProgram = CreateVertFragProgramFromPath(
         "quad.vert",
         "quad.frag");
     glUseProgram(QuadProgram);
 
-    NVGcontext* NVG = nvgCreateGL3(0);
-
-
     const char* VideoNames[] = {
         "videos/Martin_Luther_King_PBS_interview_with_Kenneth_B._Clark_1963.mp4",
         "videos/Martin_Luther_King_Ive_Been_To_The_Mountaintop_1968.mp4",
@@ -72,51 +148,168 @@ int main(int argc, char const *argv[])
 
     const size_t NumVideos = ARRAY_LEN(VideoNames);
     const float BoxSize = 1.0/NumVideos;
-    video_quad* VideoQuads = calloc(NumVideos, sizeof(video_quad));
-    for (int QuadIndex = 0; QuadIndex < NumVideos; QuadIndex++)
-    {
-        video_quad* VideoQuad = &VideoQuads[QuadIndex];
-        const char* VideoName = VideoNames[QuadIndex];
+    video** Videos = calloc(NumVideos, sizeof(video*));
+
+    // Every tile gets a wall layer big enough for the largest video
+    int LayerWidth  = 1;
+    int LayerHeight = 1;
+    for (int VideoIndex = 0; VideoIndex < NumVideos; VideoIndex++) {
+        bool Muted = SoloVideo >= 0 && VideoIndex != SoloVideo;
+        video* Video = OpenVideo(VideoNames[VideoIndex], AudioState, Muted);
+        Videos[VideoIndex] = Video;
+        if (Video && LoopEnd > LoopStart) {
+            SetVideoLoop(Video, LoopStart, LoopEnd);
+        }
+        if (Video) {
+            LayerWidth  = MAX(LayerWidth,  Video->Width);
+            LayerHeight = MAX(LayerHeight, Video->Height);
+        }
+        // Known before the wall is made, so clips are cached reduced
+        SetVideoDisplaySize(Video,
+            BoxSize * WindowWidth,
+            BoxSize * WindowHeight);
+    }
+
+    // Set aside layers for every clip whose frames fit the cache budget,
+    // taking them in the order AddVideoToWall will hand them out. Cache
+    // layers are as big as the biggest reduced picture cached.
+    int CacheLayers = 0;
+    int CacheLayerWidth  = 0;
+    int CacheLayerHeight = 0;
+    for (int VideoIndex = 0; VideoIndex < NumVideos; VideoIndex++) {
+        int Frames = GetVideoCacheFrames(Videos[VideoIndex]);
+        if (Frames <= 0) continue;
+
+        int FrameWidth, FrameHeight;
+        GetVideoCacheFrameSize(Videos[VideoIndex], &FrameWidth, &FrameHeight);
+        const int Width  = MAX(CacheLayerWidth,  FrameWidth);
+        const int Height = MAX(CacheLayerHeight, FrameHeight);
+        const size_t LayerBytes = GetWallLayerBytes(Width, Height, true);
+        if ((size_t)(CacheLayers + Frames) * LayerBytes <= ClipCacheBytes) {
+            CacheLayers += Frames;
+            CacheLayerWidth  = Width;
+            CacheLayerHeight = Height;
+        }
+    }
+
+    wall* Wall = CreateWall(QuadProgram, NumVideos, LayerWidth, LayerHeight,
+        CacheLayers, CacheLayerWidth, CacheLayerHeight, true);
 
-        VideoQuad->Video = OpenVideo(VideoName, NVG, AudioState);
+    for (int VideoIndex = 0; VideoIndex < NumVideos; VideoIndex++) {
+        video* Video = Videos[VideoIndex];
 
-        const float X0 = BoxSize * (QuadIndex + 0) * 2 - 1;
-        const float X1 = BoxSize * (QuadIndex + 1) * 2 - 1;
+        const float X0 = BoxSize * (VideoIndex + 0) * 2 - 1;
+        const float X1 = BoxSize * (VideoIndex + 1) * 2 - 1;
         const float Y0 = 0 - BoxSize;
         const float Y1 = 0 + BoxSize;
+        AddVideoToWall(Wall, Video, X0, Y0, X1, Y1);
 
-        const float Vertices[8] = {
-            X0, Y0,  // Left Top
-            X0, Y1,  // Left Bottom
-            X1, Y0,  // Right Top
-            X1, Y1   // Right Bottom
-        };
-        VideoQuad->Quad = CreateQuad(Vertices);
+        // Tiles are far smaller than the videos, so let them mipmap
+        SetVideoFilter(Video, VIDEO_FILTER_MIPMAP_WHEN_MINIFIED);
     }
 
-    while (1) {
+    uint64_t StartMicros = GetTimeInMicros();
+    uint64_t TickMicros  = 0;
+    uint64_t DrawMicros  = 0;
+    int FrameCount = 0;
+    double Sleep = 0;
+    bool NeedsRedraw = true;
+    bool Running = true;
+    while (Running) {
+
+        // Sleep until a video has a new frame due,
+        // waking early for input when there's a window
+        if (Headless) {
+            SleepSeconds(Sleep);
+            Running = FrameCount < HeadlessFrames;
+        } else {
+            SDL_Event Event;
+            int HasEvent = Sleep > 0 ?
+                SDL_WaitEventTimeout(&Event, (int)(Sleep * 1000)) :
+                SDL_PollEvent(&Event);
+            while (HasEvent) {
+                if (Event.type == SDL_QUIT) {
+                    Running = false;
+                }
+                if (Event.type == SDL_WINDOWEVENT &&
+                    Event.window.event == SDL_WINDOWEVENT_EXPOSED) {
+                    NeedsRedraw = true;
+                }
+                HasEvent = SDL_PollEvent(&Event);
+            }
+        }
+        if (!Running) break;
+
+        const double FrameStart = GetTimeInSeconds();
+        const double DisplayLead = GetDisplayLead(&Scheduler);
 
-        SDL_Event Event;
-        while (SDL_PollEvent(&Event)) {
-            if (Event.type == SDL_QUIT) exit(0);
+        uint64_t TickStart = GetTimeInMicros();
+        bool NewFrames = false;
+        for (int VideoIndex = 0; VideoIndex < NumVideos; VideoIndex++) {
+            if (TickVideo(Videos[VideoIndex], DisplayLead)) {
+                NewFrames = true;
+            }
         }
 
+        if (NewFrames || NeedsRedraw) {
+            uint64_t DrawStart = GetTimeInMicros();
 
-        glClearColor(0, 0.1, 0.1, 1);
-        glClear(GL_COLOR_BUFFER_BIT);
+            glClearColor(0, 0.1, 0.1, 1);
+            glClear(GL_COLOR_BUFFER_BIT);
 
-        for (int QuadIndex = 0; QuadIndex < NumVideos; QuadIndex++) {
-            video_quad* VideoQuad = &VideoQuads[QuadIndex];
-            TickVideo(VideoQuad->Video);
-            DrawVideo(VideoQuad, QuadProgram);
+            DrawWall(Wall);
+
+            if (Headless) {
+                // There's no swap to block on, so wait for the
+                // GPU here to have draw time include the draw
+                glFinish();
+            } else {
+                SDL_GL_SwapWindow(Window);
+            }
+            RecordPresent(&Scheduler, FrameStart, DisplayLead);
+
+            uint64_t FrameEnd = GetTimeInMicros();
+            TickMicros += DrawStart - TickStart;
+            DrawMicros += FrameEnd - DrawStart;
+            FrameCount++;
+            NeedsRedraw = false;
         }
 
-        SDL_GL_SwapWindow(Window);
+        Sleep = GetRenderSleep(&Scheduler, Videos, NumVideos);
+    }
+
+    for (int VideoIndex = 0; VideoIndex < NumVideos; VideoIndex++) {
+        PrintVideoStats(Videos[VideoIndex]);
+    }
+
+    PrintRenderStats(&Scheduler);
+    PrintAudioStats(AudioState);
+    PrintFrameBudget();
+
+    if (Headless && FrameCount) {
+        double Seconds = (GetTimeInMicros() - StartMicros) / 1000000.0;
+        printf("Headless: %i frames in %.2fs (%.1f fps)\n",
+            FrameCount, Seconds, FrameCount / Seconds);
+        printf("  tick (convert + upload): %.3fms/frame\n", TickMicros / 1000.0 / FrameCount);
+        printf("  draw:                    %.3fms/frame\n", DrawMicros / 1000.0 / FrameCount);
     }
 
-    for (int QuadIndex = 0; QuadIndex < NumVideos; QuadIndex++) {
-        video_quad* VideoQuad = &VideoQuads[QuadIndex];
-        FreeVideo(VideoQuad->Video);
+    FreeWall(Wall);
+    for (int VideoIndex = 0; VideoIndex < NumVideos; VideoIndex++) {
+        FreeVideo(Videos[VideoIndex]);
+    }
+    free(Videos);
+
+    StopAudio(AudioState);
+
+    if (Headless) {
+#ifdef HEADLESS_SUPPORTED
+        FreeHeadlessContext(HeadlessContext);
+#endif
+    } else {
+        SDL_GL_DeleteContext(GLContext);
+        SDL_DestroyWindow(Window);
+        SDL_Quit();
     }
 
     return 0;
@@ -0,0 +1,46 @@
+#include "media-clock.h"
+#include "utils.h"
+
+void InitMediaClock(media_clock* Clock, audio_state* AudioState, int AudioChannel) {
+    Clock->AudioState   = AudioState;
+    Clock->AudioChannel = AudioChannel;
+    atomic_store(&Clock->StartTime, GetTimeInSeconds());
+    atomic_store(&Clock->Held, false);
+}
+
+double GetMediaClockTime(media_clock* Clock) {
+    if (atomic_load(&Clock->Held)) {
+        return atomic_load(&Clock->HeldTime);
+    }
+
+    const double Now = GetTimeInSeconds();
+
+    double AudioTime;
+    if (Clock->AudioState &&
+        GetAudioChannelTime(Clock->AudioState, Clock->AudioChannel, &AudioTime))
+    {
+        atomic_store(&Clock->StartTime, Now - AudioTime);
+        return AudioTime;
+    }
+
+    return Now - atomic_load(&Clock->StartTime);
+}
+
+void HoldMediaClock(media_clock* Clock, double Time) {
+    atomic_store(&Clock->HeldTime, Time);
+    atomic_store(&Clock->Held, true);
+    if (Clock->AudioState) {
+        FlushAudioChannel(Clock->AudioState, Clock->AudioChannel);
+    }
+}
+
+void ReleaseMediaClock(media_clock* Clock) {
+    // Audio isn't fed while held, so the wall clock takes over
+    // until the channel has something playing again
+    atomic_store(&Clock->StartTime, GetTimeInSeconds() - atomic_load(&Clock->HeldTime));
+    atomic_store(&Clock->Held, false);
+}
+
+bool IsMediaClockHeld(media_clock* Clock) {
+    return atomic_load(&Clock->Held);
+}
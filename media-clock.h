@@ -0,0 +1,38 @@
+#ifndef MEDIA_CLOCK_H
+#define MEDIA_CLOCK_H
+
+#include <stdatomic.h>
+#include "video-audio.h"
+
+// The time a video presents its frames against.
+// Follows what's being heard on the video's audio channel,
+// and falls back to the wall clock when nothing is playing there
+// (no audio stream, no audio engine, or the audio has run out).
+typedef struct {
+    // Wall clock time of media time 0. Re-anchored on every
+    // audio reading so falling back to it doesn't jump.
+    _Atomic double StartTime;
+
+    audio_state* AudioState; // NULL to only use the wall clock
+    int AudioChannel;
+
+    // Stopped at HeldTime while a seek decodes up to it
+    atomic_bool Held;
+    _Atomic double HeldTime;
+} media_clock;
+
+void InitMediaClock(media_clock* Clock, audio_state* AudioState, int AudioChannel);
+
+double GetMediaClockTime(media_clock* Clock);
+
+// Stops the clock at the given time for a seek,
+// throwing away audio queued from before it.
+void HoldMediaClock(media_clock* Clock, double Time);
+
+// Starts the clock running again from where it was held,
+// once there's something to show there.
+void ReleaseMediaClock(media_clock* Clock);
+
+bool IsMediaClockHeld(media_clock* Clock);
+
+#endif // MEDIA_CLOCK_H
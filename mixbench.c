@@ -0,0 +1,66 @@
+// Times the mixer the way the JACK callback uses it: once per cycle,
+// the first voice is copied into the output and the rest are added.
+//   make mixbench && ./mixbench
+#include "mixer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_FRAMES  256 // Frames per JACK cycle
+#define BENCH_SECONDS 0.5 // Spent on each voice count
+#define BENCH_BATCH   64  // Cycles between clock reads
+
+static double GetSeconds() {
+    struct timespec Now;
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    return Now.tv_sec + Now.tv_nsec / 1000000000.0;
+}
+
+static void BenchmarkVoices(int NumVoices) {
+    // Interleaved stereo, like the channel sample rings
+    float* Voices = malloc(NumVoices * BENCH_FRAMES * 2 * sizeof(float));
+    float* Gains  = malloc(NumVoices * sizeof(float));
+    for (int Index = 0; Index < NumVoices * BENCH_FRAMES * 2; Index++) {
+        Voices[Index] = (float)rand() / RAND_MAX * 2 - 1;
+    }
+    for (int Voice = 0; Voice < NumVoices; Voice++) {
+        Gains[Voice] = 1.0f / NumVoices;
+    }
+
+    float Left[BENCH_FRAMES];
+    float Right[BENCH_FRAMES];
+    double Checksum = 0;
+
+    long Cycles = 0;
+    double Start = GetSeconds();
+    double Elapsed;
+    do {
+        for (int Batch = 0; Batch < BENCH_BATCH; Batch++) {
+            CopyInterleavedStereo(Left, Right, Voices, BENCH_FRAMES, Gains[0]);
+            for (int Voice = 1; Voice < NumVoices; Voice++) {
+                MixInterleavedStereo(Left, Right,
+                    Voices + Voice * BENCH_FRAMES * 2, BENCH_FRAMES, Gains[Voice]);
+            }
+            // Keeps the mixing from being optimized away
+            Checksum += Left[Batch % BENCH_FRAMES] + Right[Batch % BENCH_FRAMES];
+        }
+        Cycles += BENCH_BATCH;
+        Elapsed = GetSeconds() - Start;
+    } while (Elapsed < BENCH_SECONDS);
+
+    double NanosPerSample = Elapsed * 1000000000.0 / ((double)Cycles * BENCH_FRAMES);
+    printf("%4i voices: %8.2f ns/output sample, %6.3f ns/voice sample (checksum %g)\n",
+        NumVoices, NanosPerSample, NanosPerSample / NumVoices, Checksum);
+
+    free(Gains);
+    free(Voices);
+}
+
+int main(int argc, char const *argv[])
+{
+    const int VoiceCounts[] = { 16, 64, 256 };
+    for (int Index = 0; Index < (int)(sizeof(VoiceCounts) / sizeof(*VoiceCounts)); Index++) {
+        BenchmarkVoices(VoiceCounts[Index]);
+    }
+    return 0;
+}
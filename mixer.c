@@ -0,0 +1,106 @@
+#include "mixer.h"
+#include <string.h>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define MIX_WIDTH 8
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#define MIX_WIDTH 4
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define MIX_WIDTH 4
+#else
+#define MIX_WIDTH 1
+#endif
+
+// Each splits MIX_WIDTH interleaved frames at In into Left and Right,
+// scaled by Gain.
+#if defined(__AVX__)
+static inline void Deinterleave(const float* In, __m256 Gains, __m256* Left, __m256* Right) {
+    __m256 A = _mm256_loadu_ps(In);     // L0 R0 L1 R1 | L2 R2 L3 R3
+    __m256 B = _mm256_loadu_ps(In + 8); // L4 R4 L5 R5 | L6 R6 L7 R7
+    __m256 Low  = _mm256_permute2f128_ps(A, B, 0x20); // L0 R0 L1 R1 | L4 R4 L5 R5
+    __m256 High = _mm256_permute2f128_ps(A, B, 0x31); // L2 R2 L3 R3 | L6 R6 L7 R7
+    *Left  = _mm256_mul_ps(_mm256_shuffle_ps(Low, High, _MM_SHUFFLE(2, 0, 2, 0)), Gains);
+    *Right = _mm256_mul_ps(_mm256_shuffle_ps(Low, High, _MM_SHUFFLE(3, 1, 3, 1)), Gains);
+}
+#elif defined(__SSE__)
+static inline void Deinterleave(const float* In, __m128 Gains, __m128* Left, __m128* Right) {
+    __m128 A = _mm_loadu_ps(In);     // L0 R0 L1 R1
+    __m128 B = _mm_loadu_ps(In + 4); // L2 R2 L3 R3
+    *Left  = _mm_mul_ps(_mm_shuffle_ps(A, B, _MM_SHUFFLE(2, 0, 2, 0)), Gains);
+    *Right = _mm_mul_ps(_mm_shuffle_ps(A, B, _MM_SHUFFLE(3, 1, 3, 1)), Gains);
+}
+#endif
+
+void CopyInterleavedStereo(float* OutLeft, float* OutRight,
+    const float* In, int Count, float Gain) {
+
+    int Index = 0;
+#if defined(__AVX__)
+    const __m256 Gains = _mm256_set1_ps(Gain);
+    for (; Index + MIX_WIDTH <= Count; Index += MIX_WIDTH) {
+        __m256 Left, Right;
+        Deinterleave(In + Index * 2, Gains, &Left, &Right);
+        _mm256_storeu_ps(OutLeft  + Index, Left);
+        _mm256_storeu_ps(OutRight + Index, Right);
+    }
+#elif defined(__SSE__)
+    const __m128 Gains = _mm_set1_ps(Gain);
+    for (; Index + MIX_WIDTH <= Count; Index += MIX_WIDTH) {
+        __m128 Left, Right;
+        Deinterleave(In + Index * 2, Gains, &Left, &Right);
+        _mm_storeu_ps(OutLeft  + Index, Left);
+        _mm_storeu_ps(OutRight + Index, Right);
+    }
+#elif defined(__ARM_NEON)
+    for (; Index + MIX_WIDTH <= Count; Index += MIX_WIDTH) {
+        float32x4x2_t Frames = vld2q_f32(In + Index * 2);
+        vst1q_f32(OutLeft  + Index, vmulq_n_f32(Frames.val[0], Gain));
+        vst1q_f32(OutRight + Index, vmulq_n_f32(Frames.val[1], Gain));
+    }
+#endif
+    for (; Index < Count; Index++) {
+        OutLeft[Index]  = In[Index * 2 + 0] * Gain;
+        OutRight[Index] = In[Index * 2 + 1] * Gain;
+    }
+}
+
+void MixInterleavedStereo(float* OutLeft, float* OutRight,
+    const float* In, int Count, float Gain) {
+
+    int Index = 0;
+#if defined(__AVX__)
+    const __m256 Gains = _mm256_set1_ps(Gain);
+    for (; Index + MIX_WIDTH <= Count; Index += MIX_WIDTH) {
+        __m256 Left, Right;
+        Deinterleave(In + Index * 2, Gains, &Left, &Right);
+        _mm256_storeu_ps(OutLeft  + Index, _mm256_add_ps(_mm256_loadu_ps(OutLeft  + Index), Left));
+        _mm256_storeu_ps(OutRight + Index, _mm256_add_ps(_mm256_loadu_ps(OutRight + Index), Right));
+    }
+#elif defined(__SSE__)
+    const __m128 Gains = _mm_set1_ps(Gain);
+    for (; Index + MIX_WIDTH <= Count; Index += MIX_WIDTH) {
+        __m128 Left, Right;
+        Deinterleave(In + Index * 2, Gains, &Left, &Right);
+        _mm_storeu_ps(OutLeft  + Index, _mm_add_ps(_mm_loadu_ps(OutLeft  + Index), Left));
+        _mm_storeu_ps(OutRight + Index, _mm_add_ps(_mm_loadu_ps(OutRight + Index), Right));
+    }
+#elif defined(__ARM_NEON)
+    for (; Index + MIX_WIDTH <= Count; Index += MIX_WIDTH) {
+        float32x4x2_t Frames = vld2q_f32(In + Index * 2);
+        vst1q_f32(OutLeft  + Index, vmlaq_n_f32(vld1q_f32(OutLeft  + Index), Frames.val[0], Gain));
+        vst1q_f32(OutRight + Index, vmlaq_n_f32(vld1q_f32(OutRight + Index), Frames.val[1], Gain));
+    }
+#endif
+    for (; Index < Count; Index++) {
+        OutLeft[Index]  += In[Index * 2 + 0] * Gain;
+        OutRight[Index] += In[Index * 2 + 1] * Gain;
+    }
+}
+
+void ClearStereo(float* OutLeft, float* OutRight, int Count) {
+    memset(OutLeft,  0, Count * sizeof(float));
+    memset(OutRight, 0, Count * sizeof(float));
+}
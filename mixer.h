@@ -0,0 +1,19 @@
+#ifndef MIXER_H
+#define MIXER_H
+
+// Mixing primitives for the audio callback. They work on whole runs
+// of interleaved stereo frames, writing to JACK's separate left and
+// right buffers, and are vectorized with AVX, SSE or NEON where the
+// compiler targets them, falling back to plain loops.
+
+// Writes Gain * In to the outputs.
+void CopyInterleavedStereo(float* OutLeft, float* OutRight,
+    const float* In, int Count, float Gain);
+
+// Adds Gain * In to the outputs.
+void MixInterleavedStereo(float* OutLeft, float* OutRight,
+    const float* In, int Count, float Gain);
+
+void ClearStereo(float* OutLeft, float* OutRight, int Count);
+
+#endif // MIXER_H
@@ -6,8 +6,14 @@
 void InitGLEW() {
     // Initialize GLEW
     glewExperimental = GL_TRUE;
-    if(glewInit() != GLEW_OK) {
-        printf("Could not init glew.\n");
+    GLenum GLEWResult = glewInit();
+    if (GLEWResult == GLEW_ERROR_NO_GLX_DISPLAY) {
+        // GLX builds of GLEW look for an X display even under EGL,
+        // so load the entry points from the current context directly
+        GLEWResult = glewContextInit();
+    }
+    if (GLEWResult != GLEW_OK) {
+        printf("Could not init glew: %s\n", glewGetErrorString(GLEWResult));
         exit(1);
     }
     GLenum GLEWError = glGetError();
@@ -38,7 +44,7 @@ GLuint CreateQuad(const float* QuadVertices) {
     GLuint VertBuffer;
     glGenBuffers(1, &VertBuffer);
     glBindBuffer(GL_ARRAY_BUFFER, VertBuffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(QuadVertices)*8, QuadVertices, GL_STATIC_DRAW);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(*QuadVertices)*8, QuadVertices, GL_STATIC_DRAW);
 
     const GLuint PositionAttrIndex = 0; // layout(location = 0) in vert shader
     glVertexAttribPointer(
@@ -1,12 +1,91 @@
 #version 410 core
 
-in vec2 vUV;
+in vec2 vLumaUV;
+in vec2 vChromaUV;
+flat in vec4 vUVScale; // Part of the layer the video fills: luma xy, chroma zw
+flat in vec4 vParams; // Layer, color matrix, full range, use mipmaps
+flat in float vCached; // Layer is in the cache textures
 out vec4 fragColor;
 
-uniform sampler2D uTex;
+// Planes may be subsampled (4:2:0, 4:2:2) or full size (4:4:4);
+// each has its own UVs into its layer.
+uniform sampler2DArray uTexY;
+uniform sampler2DArray uTexU;
+uniform sampler2DArray uTexV;
+
+// Short clips' frame caches, in smaller layers of their own
+uniform sampler2DArray uCacheY;
+uniform sampler2DArray uCacheU;
+uniform sampler2DArray uCacheV;
+
+// Must match color_matrix in video.h
+const int COLOR_MATRIX_BT601 = 0;
+const int COLOR_MATRIX_BT709 = 1;
+
+vec3 yuvToRGB(vec3 yuv, int colorMatrix, bool fullRange) {
+    if (fullRange) {
+        yuv -= vec3(0.0, 0.5, 0.5);
+    } else {
+        // Limited range: luma in 16-235, chroma in 16-240
+        yuv = (yuv - vec3(16.0, 128.0, 128.0) / 255.0)
+            * vec3(255.0 / 219.0, 255.0 / 224.0, 255.0 / 224.0);
+    }
+
+    float kr = colorMatrix == COLOR_MATRIX_BT709 ? 0.2126 : 0.299;
+    float kb = colorMatrix == COLOR_MATRIX_BT709 ? 0.0722 : 0.114;
+    float kg = 1.0 - kr - kb;
+
+    float r = yuv.x + 2.0 * (1.0 - kr) * yuv.z;
+    float b = yuv.x + 2.0 * (1.0 - kb) * yuv.y;
+    float g = (yuv.x - kr * r - kb * b) / kg;
+
+    return clamp(vec3(r, g, b), 0.0, 1.0);
+}
+
+// The furthest uv can reach at a level without the linear filter
+// reading past the picture, which fills the top-left scale of the layer.
+// Levels are built from the picture alone, each rounded up from the one
+// before, as GenerateTextureLayerMipmaps does.
+vec2 maxUVAtLevel(vec2 scale, vec2 layerSize, float level) {
+    float texel = exp2(level);
+    vec2 picture = ceil(floor(scale * layerSize + 0.5) / texel);
+    return (picture - 0.5) * texel / layerSize;
+}
+
+// Videos whose mips weren't rebuilt for this frame only read level 0.
+// vParams is flat, so the branch is uniform across each primitive.
+float samplePlane(sampler2DArray tex, vec2 uv, vec2 scale) {
+    vec2 layerSize = vec2(textureSize(tex, 0).xy);
+    if (vParams.w > 0.5) {
+        // Trilinear reads the levels either side of this one. The level
+        // comes from the unclamped uv, which stays smooth at the edge.
+        vec2 dx = dFdx(uv);
+        vec2 dy = dFdy(uv);
+        float level = textureQueryLod(tex, uv).x;
+        uv = min(uv, min(maxUVAtLevel(scale, layerSize, floor(level)),
+                         maxUVAtLevel(scale, layerSize, ceil(level))));
+        return textureGrad(tex, vec3(uv, vParams.x), dx, dy).r;
+    }
+    uv = min(uv, maxUVAtLevel(scale, layerSize, 0.0));
+    return textureLod(tex, vec3(uv, vParams.x), 0.0).r;
+}
 
 void main() {
-    vec3 rgb = texture(uTex, vUV).rgb;
+    // vCached is flat too, so each tile takes one side
+    vec3 yuv;
+    if (vCached > 0.5) {
+        yuv = vec3(
+            samplePlane(uCacheY, vLumaUV,   vUVScale.xy),
+            samplePlane(uCacheU, vChromaUV, vUVScale.zw),
+            samplePlane(uCacheV, vChromaUV, vUVScale.zw));
+    } else {
+        yuv = vec3(
+            samplePlane(uTexY, vLumaUV,   vUVScale.xy),
+            samplePlane(uTexU, vChromaUV, vUVScale.zw),
+            samplePlane(uTexV, vChromaUV, vUVScale.zw));
+    }
 
-    fragColor = vec4(rgb, 1.0);
+    int colorMatrix = int(vParams.y + 0.5);
+    bool fullRange = vParams.z > 0.5;
+    fragColor = vec4(yuvToRGB(yuv, colorMatrix, fullRange), 1.0);
 }
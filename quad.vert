@@ -1,11 +1,25 @@
 #version 410 core
 
-layout(location = 0) in vec2 aPosition;
+layout(location = 0) in vec2 aPosition; // Corner of the unit quad
 layout(location = 1) in vec2 aUV;
 
-out vec2 vUV;
+// Per instance, see wall_instance in wall.h
+layout(location = 2) in vec4 aRect;     // Clip space x0, y0, x1, y1
+layout(location = 3) in vec4 aUVScale;  // Part of the layer the video fills: luma xy, chroma zw
+layout(location = 4) in vec4 aParams;   // Layer, color matrix, full range, use mipmaps
+layout(location = 5) in float aCached;  // Layer is in the cache textures
+
+out vec2 vLumaUV;
+out vec2 vChromaUV;
+flat out vec4 vUVScale;
+flat out vec4 vParams;
+flat out float vCached;
 
 void main() {
-    gl_Position = vec4(aPosition, 0.0, 1.0);
-    vUV = aUV;
+    gl_Position = vec4(mix(aRect.xy, aRect.zw, aPosition), 0.0, 1.0);
+    vLumaUV   = aUV * aUVScale.xy;
+    vChromaUV = aUV * aUVScale.zw;
+    vUVScale  = aUVScale;
+    vParams   = aParams;
+    vCached   = aCached;
 }
@@ -0,0 +1,90 @@
+#include "render-scheduler.h"
+#include "utils.h"
+#include <stdio.h>
+#include <math.h>
+
+// Longest sleep while some video has nothing buffered yet,
+// since decoders don't wake the render loop
+#define RENDER_POLL_SECONDS 0.005
+
+// Weight of the newest frame in the smoothed frame cost
+#define FRAME_COST_SMOOTHING 0.1
+
+#define DEFAULT_REFRESH_RATE 60.0
+
+void InitRenderScheduler(render_scheduler* Scheduler, bool VSync, double RefreshRate) {
+    *Scheduler = (render_scheduler){
+        .VSync           = VSync,
+        .RefreshInterval = 1.0 / (RefreshRate > 0 ? RefreshRate : DEFAULT_REFRESH_RATE),
+        .LastPresentTime = GetTimeInSeconds()
+    };
+}
+
+double GetDisplayLead(render_scheduler* Scheduler) {
+    if (!Scheduler->VSync) {
+        return Scheduler->FrameCost;
+    }
+
+    // Swaps land on refreshes, so predict the first
+    // refresh we can still finish drawing before
+    const double Now = GetTimeInSeconds();
+    const double Interval = Scheduler->RefreshInterval;
+    double SinceLast = Now - Scheduler->LastPresentTime;
+    double NextRefresh = Scheduler->LastPresentTime +
+        Interval * ceil(MAX(SinceLast, 0) / Interval);
+    while (NextRefresh - Now < Scheduler->FrameCost) {
+        NextRefresh += Interval;
+    }
+    return NextRefresh - Now;
+}
+
+void RecordPresent(render_scheduler* Scheduler, double FrameStart, double DisplayLead) {
+    const double Now = GetTimeInSeconds();
+
+    double Cost = Now - FrameStart;
+    Scheduler->FrameCost = Scheduler->FramesPresented ?
+        Scheduler->FrameCost + FRAME_COST_SMOOTHING * (Cost - Scheduler->FrameCost) :
+        Cost;
+
+    double PresentError = fabs(Now - (FrameStart + DisplayLead));
+    Scheduler->TotalPresentError += PresentError;
+    Scheduler->MaxPresentError = MAX(Scheduler->MaxPresentError, PresentError);
+
+    Scheduler->LastPresentTime = Now;
+    Scheduler->FramesPresented++;
+}
+
+double GetRenderSleep(render_scheduler* Scheduler, video** Videos, int NumVideos) {
+    const double Lead = GetDisplayLead(Scheduler);
+
+    double Sleep = INFINITY;
+    for (int VideoIndex = 0; VideoIndex < NumVideos; VideoIndex++) {
+        if (!Videos[VideoIndex]) continue;
+
+        double Wait = GetVideoTimeUntilNextFrame(Videos[VideoIndex], Lead);
+        if (Wait < 0) {
+            Wait = RENDER_POLL_SECONDS;
+        }
+        Sleep = MIN(Sleep, Wait);
+    }
+    if (isinf(Sleep)) {
+        Sleep = RENDER_POLL_SECONDS;
+    }
+
+    Scheduler->Wakeups++;
+    Scheduler->SleptSeconds += Sleep;
+    return Sleep;
+}
+
+void PrintRenderStats(render_scheduler* Scheduler) {
+    uint64_t Frames = Scheduler->FramesPresented;
+    printf("Render: %llu frames presented over %llu wakeups, %.2fs asleep, "
+        "frame cost %.3fms, presentation error %.3fms avg / %.3fms max%s\n",
+        (unsigned long long)Frames,
+        (unsigned long long)Scheduler->Wakeups,
+        Scheduler->SleptSeconds,
+        Scheduler->FrameCost * 1000.0,
+        Frames ? Scheduler->TotalPresentError / Frames * 1000.0 : 0,
+        Scheduler->MaxPresentError * 1000.0,
+        Scheduler->VSync ? " (vsync)" : "");
+}
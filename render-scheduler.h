@@ -0,0 +1,39 @@
+#ifndef RENDER_SCHEDULER_H
+#define RENDER_SCHEDULER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "video.h"
+
+// Paces the render loop: frames are only drawn when some video has a
+// new one to show, and the loop sleeps until the soonest is due.
+// Videos pick their frames for when the drawing will be seen (the next
+// vsync, or now plus the usual time to draw) rather than for now.
+typedef struct {
+    bool   VSync;
+    double RefreshInterval;  // Seconds per refresh, when VSync is on
+    double LastPresentTime;  // When the last frame was handed to the display
+    double FrameCost;        // Smoothed time from starting a frame to presenting it
+
+    uint64_t FramesPresented;
+    uint64_t Wakeups;        // Times the loop went around
+    double   SleptSeconds;   // Sleep handed out by GetRenderSleep
+    double   TotalPresentError; // Of each present against its predicted time
+    double   MaxPresentError;
+} render_scheduler;
+
+void InitRenderScheduler(render_scheduler* Scheduler, bool VSync, double RefreshRate);
+
+// How long after now the frame about to be drawn will be seen.
+double GetDisplayLead(render_scheduler* Scheduler);
+
+// Call once a frame has been swapped (or finished, offscreen).
+// FrameStart and DisplayLead are from when the frame was begun.
+void RecordPresent(render_scheduler* Scheduler, double FrameStart, double DisplayLead);
+
+// How long the loop can sleep before some video has a new frame to draw.
+double GetRenderSleep(render_scheduler* Scheduler, video** Videos, int NumVideos);
+
+void PrintRenderStats(render_scheduler* Scheduler);
+
+#endif // RENDER_SCHEDULER_H
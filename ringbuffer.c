@@ -90,6 +90,38 @@ ring_buffer_size_t AdvanceRingBufferReadIndex(
     return PaUtil_AdvanceRingBufferReadIndex(rbuf, elementCount);
 }
 
+// The region functions give direct access to the storage, so elements
+// can be produced or consumed in place rather than copied through.
+ring_buffer_size_t GetRingBufferWriteRegions(
+    ringbuffer*         RingBuffer,
+    ring_buffer_size_t  ElementCount,
+    void**              Data1,
+    ring_buffer_size_t* Size1,
+    void**              Data2,
+    ring_buffer_size_t* Size2)
+{
+    return PaUtil_GetRingBufferWriteRegions(&RingBuffer->RingBuffer,
+        ElementCount, Data1, Size1, Data2, Size2);
+}
+
+ring_buffer_size_t AdvanceRingBufferWriteIndex(
+    ringbuffer* RingBuffer,
+    ring_buffer_size_t ElementCount)
+{
+    return PaUtil_AdvanceRingBufferWriteIndex(&RingBuffer->RingBuffer, ElementCount);
+}
+
+ring_buffer_size_t GetRingBufferReadRegions(
+    ringbuffer*         RingBuffer,
+    ring_buffer_size_t  ElementCount,
+    void**              Data1,
+    ring_buffer_size_t* Size1,
+    void**              Data2,
+    ring_buffer_size_t* Size2)
+{
+    return PaUtil_GetRingBufferReadRegions(&RingBuffer->RingBuffer,
+        ElementCount, Data1, Size1, Data2, Size2);
+}
 
 void FreeRingBuffer(ringbuffer* RingBuffer) {
     free(RingBuffer->Storage);
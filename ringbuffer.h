@@ -34,6 +34,28 @@ ring_buffer_size_t AdvanceRingBufferReadIndex(
     ringbuffer* RingBuffer,
     ring_buffer_size_t elementCount);
 
+// Regions to fill or drain in place. The second is only used
+// when the elements wrap around the end of the storage.
+ring_buffer_size_t GetRingBufferWriteRegions(
+    ringbuffer*         RingBuffer,
+    ring_buffer_size_t  ElementCount,
+    void**              Data1,
+    ring_buffer_size_t* Size1,
+    void**              Data2,
+    ring_buffer_size_t* Size2);
+
+ring_buffer_size_t AdvanceRingBufferWriteIndex(
+    ringbuffer* RingBuffer,
+    ring_buffer_size_t ElementCount);
+
+ring_buffer_size_t GetRingBufferReadRegions(
+    ringbuffer*         RingBuffer,
+    ring_buffer_size_t  ElementCount,
+    void**              Data1,
+    ring_buffer_size_t* Size1,
+    void**              Data2,
+    ring_buffer_size_t* Size2);
+
 void FreeRingBuffer(ringbuffer* Ringbuffer);
 
 #endif // RINGBUFFER_H
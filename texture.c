@@ -1,4 +1,5 @@
 #include "texture.h"
+#include "utils.h"
 
 int BGRAChannelsToGL(int channels) {
     switch(channels) {
@@ -20,16 +21,37 @@ int RGBAChannelsToGL(int channels) {
     }
 }
 
+int ChannelsToInternalFormat(int channels) {
+    switch(channels) {
+        case 4: return GL_RGBA8;
+        case 3: return GL_RGB8;
+        case 2: return GL_RG8;
+        case 1: return GL_R8;
+        default: return -1;
+    }
+}
+
 static const int RGBASwizzleMask[] = {GL_RED, GL_GREEN, GL_BLUE, GL_ALPHA};
 static const int GrayscaleSwizzleMask[] = {GL_RED, GL_RED, GL_RED, GL_ONE};
 
-int CreateTexture(int width, int height, int channels) {
+int GetMipLevelCount(int Width, int Height) {
+    int Size = Width > Height ? Width : Height;
+    int Levels = 1;
+    while (Size > 1) {
+        Size >>= 1;
+        Levels++;
+    }
+    return Levels;
+}
+
+int CreateTexture(int width, int height, int channels, int levels) {
     GLuint Tex;
     glGenTextures(1, &Tex);
     glBindTexture(GL_TEXTURE_2D, Tex);
 
 
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+        levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
     // glTextureParameterf(Tex, GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, 16);
@@ -45,8 +67,8 @@ int CreateTexture(int width, int height, int channels) {
 
     glTexStorage2D(
         GL_TEXTURE_2D,
-        1,
-        GL_RGB8,
+        levels,
+        ChannelsToInternalFormat(channels),
         width,
         height);
 
@@ -57,14 +79,14 @@ int CreateTexture(int width, int height, int channels) {
     return Tex;
 }
 
-void UpdateTexture(GLuint Tex, int Width, int Height, GLenum Format, const void* Data) {
+void UpdateTexture(GLuint Tex, int Width, int Height, int Stride, GLenum Format, const void* Data) {
     const GLenum ImageType = GL_UNSIGNED_BYTE;
 
     glBindTexture(GL_TEXTURE_2D, Tex);
     // Use RGB(a) or copy single-channel images to all channels for grayscale
     const int* SwizzleMask = Format == GL_RED ? GrayscaleSwizzleMask : RGBASwizzleMask;
     glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, SwizzleMask);
-    // glPixelStorei(GL_UNPACK_ROW_LENGTH, Stride);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, Stride);
 
     glTexSubImage2D(GL_TEXTURE_2D,
         0,
@@ -74,5 +96,86 @@ void UpdateTexture(GLuint Tex, int Width, int Height, GLenum Format, const void*
         ImageType,
         Data);
 
-    glGenerateMipmap(GL_TEXTURE_2D);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
+
+int CreateTextureArray(int Width, int Height, int Layers, int Channels, int Levels) {
+    GLuint Tex;
+    glGenTextures(1, &Tex);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, Tex);
+
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER,
+        Levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    glTexStorage3D(
+        GL_TEXTURE_2D_ARRAY,
+        Levels,
+        ChannelsToInternalFormat(Channels),
+        Width,
+        Height,
+        Layers);
+
+    const int* SwizzleMask = Channels == 1 ? GrayscaleSwizzleMask : RGBASwizzleMask;
+    glTexParameteriv(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_SWIZZLE_RGBA, SwizzleMask);
+
+    return Tex;
+}
+
+void UpdateTextureLayer(GLuint Tex, int Layer, int Width, int Height, int Stride, GLenum Format, const void* Data) {
+    glBindTexture(GL_TEXTURE_2D_ARRAY, Tex);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, Stride);
+
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY,
+        0,
+        0, 0, Layer,
+        Width, Height, 1,
+        Format,
+        GL_UNSIGNED_BYTE,
+        Data);
+
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
+
+// A chain of linear blits, level to level, over just the part of the
+// layer the picture fills. glGenerateMipmap would need a view per layer
+// (GL 4.3) and would average in whatever is left beyond the picture.
+void GenerateTextureLayerMipmaps(GLuint Tex, int Layer, int Levels, int Width, int Height) {
+    if (Levels <= 1) return;
+
+    static GLuint Framebuffers[2];
+    if (!Framebuffers[0]) {
+        glGenFramebuffers(2, Framebuffers);
+    }
+
+    // Put back whatever was being drawn to, e.g. the headless FBO
+    GLint PreviousRead, PreviousDraw;
+    glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &PreviousRead);
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &PreviousDraw);
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, Framebuffers[0]);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, Framebuffers[1]);
+    int SourceWidth  = Width;
+    int SourceHeight = Height;
+    for (int Level = 1; Level < Levels; Level++) {
+        // Rounded up, so the last row and column still have a texel to
+        // land in. quad.frag clamps its reads to these same sizes.
+        const int LevelWidth  = (SourceWidth  + 1) / 2;
+        const int LevelHeight = (SourceHeight + 1) / 2;
+        glFramebufferTextureLayer(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, Tex, Level - 1, Layer);
+        glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, Tex, Level, Layer);
+        glBlitFramebuffer(
+            0, 0, SourceWidth, SourceHeight,
+            0, 0, LevelWidth, LevelHeight,
+            GL_COLOR_BUFFER_BIT, GL_LINEAR);
+        SourceWidth  = LevelWidth;
+        SourceHeight = LevelHeight;
+    }
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, PreviousRead);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, PreviousDraw);
 }
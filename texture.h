@@ -3,8 +3,24 @@
 
 #include <GL/glew.h>
 
-int CreateTexture(int width, int height, int channels);
+#include <stdbool.h>
 
-void UpdateTexture(GLuint Tex, int Width, int Height, GLenum Format, const void* Data);
+// Levels is the number of mip levels to allocate; 1 for no mipmaps.
+int CreateTexture(int width, int height, int channels, int levels);
+
+// A GL_TEXTURE_2D_ARRAY of Layers images of the same size.
+int CreateTextureArray(int Width, int Height, int Layers, int Channels, int Levels);
+
+int GetMipLevelCount(int Width, int Height);
+
+// Stride is the length of a row of Data in pixels, or 0 if rows are tightly packed.
+void UpdateTexture(GLuint Tex, int Width, int Height, int Stride, GLenum Format, const void* Data);
+
+// Updates the top-left Width x Height of one layer of a texture array.
+void UpdateTextureLayer(GLuint Tex, int Layer, int Width, int Height, int Stride, GLenum Format, const void* Data);
+
+// Rebuilds the first Levels mips of one layer of a texture array from
+// the top-left Width x Height of its level 0, leaving the rest alone.
+void GenerateTextureLayerMipmaps(GLuint Tex, int Layer, int Levels, int Width, int Height);
 
 #endif // TEXTURE_H
@@ -0,0 +1,87 @@
+#include "upload.h"
+#include "utils.h"
+
+// How long each wait for the GPU to free a region blocks before checking again
+#define UPLOAD_WAIT_TIMEOUT_NS 100000000 // 100ms
+
+void CreateUploadRing(upload_ring* Ring, size_t SlotSize) {
+    *Ring = (upload_ring){ 0 };
+    Ring->SlotSize = SlotSize;
+
+    const size_t BufferSize = SlotSize * UPLOAD_RING_SIZE;
+
+    glGenBuffers(1, &Ring->Buffer);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, Ring->Buffer);
+
+    if (GLEW_ARB_buffer_storage) {
+        const GLbitfield Flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_PIXEL_UNPACK_BUFFER, BufferSize, NULL, Flags);
+        Ring->Mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, BufferSize, Flags);
+        Ring->Persistent = true;
+    } else {
+        // e.g. macOS's GL 4.1: map each region as we write it
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, BufferSize, NULL, GL_STREAM_DRAW);
+    }
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+// Blocks until the GPU has finished reading the region the fence guards.
+// With three regions this only waits when the GPU is frames behind.
+static void WaitForRegion(GLsync Fence) {
+    if (!Fence) return;
+
+    GLbitfield Flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+    while (1) {
+        GLenum Result = glClientWaitSync(Fence, Flags, UPLOAD_WAIT_TIMEOUT_NS);
+        if (Result != GL_TIMEOUT_EXPIRED) {
+            // Signaled, or the wait failed and there's nothing better to do
+            return;
+        }
+        // Commands only need flushing once
+        Flags = 0;
+    }
+}
+
+uint8_t* BeginUpload(upload_ring* Ring, size_t* OffsetOut) {
+    Ring->CurrentSlot = (Ring->CurrentSlot + 1) % UPLOAD_RING_SIZE;
+    WaitForRegion(Ring->Fences[Ring->CurrentSlot]);
+
+    const size_t Offset = Ring->CurrentSlot * Ring->SlotSize;
+    *OffsetOut = Offset;
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, Ring->Buffer);
+
+    if (Ring->Persistent) {
+        return Ring->Mapped + Offset;
+    }
+
+    // The fence already tells us the GPU is done with this region
+    Ring->Mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, Offset, Ring->SlotSize,
+        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    return Ring->Mapped;
+}
+
+void EndUploadWrites(upload_ring* Ring) {
+    if (!Ring->Persistent) {
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        Ring->Mapped = NULL;
+    }
+}
+
+void FinishUpload(upload_ring* Ring) {
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    LockSync(&Ring->Fences[Ring->CurrentSlot]);
+}
+
+void FreeUploadRing(upload_ring* Ring) {
+    for (int Slot = 0; Slot < UPLOAD_RING_SIZE; Slot++) {
+        glDeleteSync(Ring->Fences[Slot]);
+    }
+    if (Ring->Persistent) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, Ring->Buffer);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+    glDeleteBuffers(1, &Ring->Buffer);
+}
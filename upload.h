@@ -0,0 +1,42 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include <GL/glew.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A ring of pixel unpack buffer regions for streaming texture uploads.
+// Pixels are written straight into mapped buffer memory, and the
+// texture upload from the buffer happens asynchronously on the GPU.
+// Each region is guarded by a fence so it isn't overwritten while
+// the GPU may still be reading from it.
+
+#define UPLOAD_RING_SIZE 3
+
+typedef struct {
+    GLuint   Buffer;
+    size_t   SlotSize;
+    bool     Persistent; // Mapped once with ARB_buffer_storage
+    uint8_t* Mapped;     // Start of the whole ring while mapped
+    int      CurrentSlot;
+    GLsync   Fences[UPLOAD_RING_SIZE];
+} upload_ring;
+
+void CreateUploadRing(upload_ring* Ring, size_t SlotSize);
+
+// Waits for the next region to be free, and returns where to write
+// the pixels. *OffsetOut is the region's offset into the buffer;
+// pass offsets from it as the data pointer to texture uploads.
+uint8_t* BeginUpload(upload_ring* Ring, size_t* OffsetOut);
+
+// Leaves the buffer bound as GL_PIXEL_UNPACK_BUFFER,
+// ready for texture uploads from the region.
+void EndUploadWrites(upload_ring* Ring);
+
+// Call after issuing the texture uploads that read the region.
+void FinishUpload(upload_ring* Ring);
+
+void FreeUploadRing(upload_ring* Ring);
+
+#endif // UPLOAD_H
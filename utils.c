@@ -6,7 +6,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
-#include <sys/time.h>
+#include <time.h>
 
 
 void Fatal(const char *format, ...)
@@ -29,26 +29,36 @@ void Graph(char* sym, int N) {
     printf("\n");
 }
 
+// Monotonic, so NTP adjustments can't make time jump
 uint64_t GetTimeInMicros () {
-    struct timeval Now;
-    gettimeofday(&Now, NULL);
-    return Now.tv_sec * (uint64_t)1000000 + Now.tv_usec;
+    struct timespec Now;
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    return Now.tv_sec * (uint64_t)1000000 + Now.tv_nsec / 1000;
+}
+
+double GetTimeInSeconds() {
+    return (double)GetTimeInMicros() / 1000000.0;
+}
+
+void SleepSeconds(double Seconds) {
+    if (Seconds <= 0) return;
+    struct timespec Duration = {
+        .tv_sec  = (time_t)Seconds,
+        .tv_nsec = (long)((Seconds - (time_t)Seconds) * 1000000000.0)
+    };
+    nanosleep(&Duration, NULL);
 }
 
 fps MakeFPS() {
-    struct timeval Now;
-    gettimeofday(&Now, NULL);
     return (fps){
-        .CurrentSecond = (int)Now.tv_sec,
+        .CurrentSecond = (int)(GetTimeInMicros() / 1000000),
         .FramesThisSecond = 0,
         .FramesLastSecond = 0
     };
 }
 
 static void SyncFPS(fps* FPS) {
-    struct timeval Now;
-    gettimeofday(&Now, NULL);
-    int NowSecond = Now.tv_sec;
+    int NowSecond = (int)(GetTimeInMicros() / 1000000);
     if (NowSecond > FPS->CurrentSecond) {
         FPS->FramesLastSecond = (NowSecond == FPS->CurrentSecond + 1) ? FPS->FramesThisSecond : 0;
         FPS->FramesThisSecond = 0;
@@ -32,6 +32,8 @@ int NextPowerOfTwo(int x);
 void Graph(char* sym, int N);
 
 uint64_t GetTimeInMicros();
+double GetTimeInSeconds();
+void SleepSeconds(double Seconds);
 
 typedef struct {
     int CurrentSecond;
@@ -1,172 +1,555 @@
 #include "video-audio.h"
+#include "audio-backend.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <time.h>
 #include "ringbuffer.h"
+#include "mixer.h"
+
+static void PublishAudioClock(audio_channel* Ch, audio_clock_reading Reading) {
+    unsigned Sequence = atomic_load_explicit(&Ch->Clock.Sequence, memory_order_relaxed);
+    atomic_store_explicit(&Ch->Clock.Sequence, Sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    Ch->Clock.Reading = Reading;
+    atomic_store_explicit(&Ch->Clock.Sequence, Sequence + 2, memory_order_release);
+}
 
-int AudioThreadCallback(
-    jack_nframes_t NumFrames, void *Arg) {
-
-    audio_state *S = (audio_state*)Arg;
-    jack_default_audio_sample_t *OutputBufferLeft  = jack_port_get_buffer(S->OutputPortLeft,  NumFrames);
-    jack_default_audio_sample_t *OutputBufferRight = jack_port_get_buffer(S->OutputPortRight, NumFrames);
-
-    // Write silence
-    float *OutLeft  = (float*)OutputBufferLeft;
-    float *OutRight = (float*)OutputBufferRight;
-    for (int SampleIndex = 0; SampleIndex < NumFrames; SampleIndex++) {
-        *OutLeft++ = 0;
-        *OutRight++ = 0;
-    }
-
-    for (int ChannelIndex = 0; ChannelIndex < NUM_CHANNELS; ChannelIndex++) {
-        audio_channel* Ch = &S->Channels[ChannelIndex];
-
-        ring_buffer_size_t NumNewBlocks =
-            GetRingBufferReadAvailable(
-                &Ch->BlocksIn);
-        for (int Index = 0; Index < NumNewBlocks; Index++) {
-            audio_block* NewBlock = &Ch->Blocks[Ch->WriteBlockIndex];
-            ReadRingBuffer(
-                &Ch->BlocksIn,
-                NewBlock,
-                1);
-            Ch->WriteBlockIndex = (Ch->WriteBlockIndex + 1) % AUDIO_QUEUE;
-        }
+// Mixes a run of a channel's frames into the output at Frame.
+// Output before Filled already holds other channels' samples and is
+// added to; output past it is still garbage, so it's overwritten.
+static void MixRun(float* OutLeft, float* OutRight, uint32_t* Filled,
+    uint32_t Frame, const float* Samples, int Count, float Gain) {
+
+    int Added = 0;
+    if (*Filled > Frame) {
+        Added = *Filled - Frame;
+        if (Added > Count) Added = Count;
+        MixInterleavedStereo(OutLeft + Frame, OutRight + Frame, Samples, Added, Gain);
+    }
+    if (Added < Count) {
+        CopyInterleavedStereo(OutLeft + Frame + Added, OutRight + Frame + Added,
+            Samples + Added * 2, Count - Added, Gain);
+        *Filled = Frame + Count;
+    }
+}
 
-        audio_block* Block = &Ch->Blocks[Ch->ReadBlockIndex];
-
-        float *OutLeft  = (float*)OutputBufferLeft;
-        float *OutRight = (float*)OutputBufferRight;
-        bool FoundSomethin = false;
-        for (int SampleIndex = 0; SampleIndex < NumFrames; SampleIndex++) {
-
-            float Amp = 0;
-
-            // Find a valid block to read from
-            bool OKToRead = false;
-            for (int Tries = 0; Tries < AUDIO_QUEUE; Tries++) {
-                if (Block->NextSampleIndex < Block->Length) {
-                    OKToRead = true;
-                    FoundSomethin = true;
-                    break;
-                }
-                else {
-                    // FIXME: should do this on the main thread
-                    free(Block->Samples);
-                    Block->Samples = NULL;
-
-                    Ch->ReadBlockIndex = (Ch->ReadBlockIndex + 1) % AUDIO_QUEUE;
-                    Block = &Ch->Blocks[Ch->ReadBlockIndex];
-                }
+// Mixes what's queued on the channel into the output.
+// Channels that aren't Audible are played at no gain.
+// Returns how many frames it had to play.
+static uint32_t MixChannel(audio_channel* Ch, bool Audible,
+    float* OutLeft, float* OutRight, uint32_t* Filled,
+    uint32_t NumFrames, uint32_t CycleFrameTime) {
+
+    const int Epoch = atomic_load_explicit(&Ch->Epoch, memory_order_acquire);
+    const float Gain = Audible ?
+        atomic_load_explicit(&Ch->Gain, memory_order_relaxed) : 0;
+    audio_block* Block = &Ch->CurrentBlock;
+    bool Played = false;
+
+    uint32_t Frame = 0;
+    while (Frame < NumFrames) {
+        if (Block->NextSampleIndex >= Block->Length) {
+            if (!ReadRingBuffer(&Ch->BlocksIn, Block, 1)) {
+                break; // Starved
             }
+            continue;
+        }
 
-            if (OKToRead) {
-                Amp = Block->Samples[Block->NextSampleIndex];
-                Block->NextSampleIndex++;
-            }
+        int Remaining = Block->Length - Block->NextSampleIndex;
 
-            *OutLeft++  += Amp;
-            *OutRight++ += Amp;
+        if (Block->Epoch != Epoch) {
+            // Queued before the last flush
+            AdvanceRingBufferReadIndex(&Ch->Samples, Remaining);
+            Block->NextSampleIndex = Block->Length;
+            continue;
         }
 
-        if (!FoundSomethin) {
-            // if (ChannelIndex == 0) printf("AUDIO THREAD STARVED\n");
+        if (!Played) {
+            PublishAudioClock(Ch, (audio_clock_reading){
+                .Playing        = true,
+                .Epoch          = Epoch,
+                .PTS            = Block->PTS + Block->NextSampleIndex * Block->SampleDuration,
+                .SampleDuration = Block->SampleDuration,
+                .FrameTime      = CycleFrameTime + Frame
+            });
+            Played = true;
         }
+
+        // Play the block's samples straight out of the ring
+        void* Regions[2];
+        ring_buffer_size_t Sizes[2];
+        int Wanted = (int)(NumFrames - Frame);
+        if (Remaining < Wanted) Wanted = Remaining;
+        ring_buffer_size_t Run = GetRingBufferReadRegions(&Ch->Samples, Wanted,
+            &Regions[0], &Sizes[0], &Regions[1], &Sizes[1]);
+        if (Run == 0) {
+            break;
+        }
+
+        if (Gain != 0) {
+            for (int Region = 0; Region < 2; Region++) {
+                if (Sizes[Region] == 0) continue;
+                MixRun(OutLeft, OutRight, Filled, Frame,
+                    Regions[Region], Sizes[Region], Gain);
+                Frame += Sizes[Region];
+            }
+        } else {
+            // Muted and voiceless channels keep time without being mixed
+            Frame += Run;
+        }
+        AdvanceRingBufferReadIndex(&Ch->Samples, Run);
+        Block->NextSampleIndex += Run;
     }
 
-    return 0;
+    return Frame;
 }
 
-int GetNextChannel(audio_state* AudioState) {
-    int Next = AudioState->NextChannel;
-    AudioState->NextChannel = (AudioState->NextChannel + 1) % NUM_CHANNELS;
-    return Next;
+static uint64_t GetMixerMicros() {
+    struct timespec Now;
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    return (uint64_t)Now.tv_sec * 1000000 + Now.tv_nsec / 1000;
 }
 
-bool StartJack(audio_state* AudioState) {
-    const char **Ports;
-    const char *ClientName = "VideoAudioEngine";
-    const char *ServerName = NULL;
-    jack_options_t Options = JackNullOption;
-    jack_status_t Status;
+// Only the mixer writes these, so plain loads and stores
+// are enough and it never waits on a reader
+static void BumpCounter(atomic_uint* Counter, unsigned Amount) {
+    unsigned Value = atomic_load_explicit(Counter, memory_order_relaxed);
+    atomic_store_explicit(Counter, Value + Amount, memory_order_relaxed);
+}
+
+static void RaiseCounter(atomic_uint* Counter, unsigned Value) {
+    if (Value > atomic_load_explicit(Counter, memory_order_relaxed)) {
+        atomic_store_explicit(Counter, Value, memory_order_relaxed);
+    }
+}
+
+static void RecordCycle(audio_state* S, uint32_t NumFrames, uint64_t Micros) {
+    audio_counters* Counters = &S->Counters;
+    const double PeriodMicros = NumFrames * 1000000.0 / S->SampleRate;
+    unsigned Permille = (unsigned)(Micros / PeriodMicros * 1000);
+
+    int Bucket = Permille / 100;
+    if (Bucket >= AUDIO_LOAD_BUCKETS) Bucket = AUDIO_LOAD_BUCKETS - 1;
+
+    BumpCounter(&Counters->LoadHistogram[Bucket], 1);
+    RaiseCounter(&Counters->MaxLoadPermille, Permille);
+    RaiseCounter(&Counters->MaxCycleMicros, (unsigned)Micros);
+    BumpCounter(&Counters->Cycles, 1);
+}
+
+// Picks up the latest voice list, unless the last retired one
+// hasn't been collected yet, in which case it's tried next cycle.
+static void TakePendingVoices(audio_state* S) {
+    if (GetRingBufferWriteAvailable(&S->RetiredVoices) < 1) {
+        return;
+    }
+    audio_voice_list* Pending = atomic_exchange_explicit(&S->PendingVoices, NULL,
+        memory_order_acquire);
+    if (Pending) {
+        WriteRingBuffer(&S->RetiredVoices, &S->Voices, 1);
+        S->Voices = Pending;
+    }
+}
+
+void MixAudio(audio_state* S, float* OutLeft, float* OutRight,
+    uint32_t NumFrames, uint32_t CycleFrameTime) {
+
+    const uint64_t CycleStart = GetMixerMicros();
 
-    AudioState->Client = jack_client_open(ClientName, Options, &Status, ServerName);
-    if (AudioState->Client == NULL) {
-        fprintf(stderr, "jack_client_open() failed, "
-             "status = 0x%2.0x\n", Status);
-        if (Status & JackServerFailed) {
-            fprintf(stderr, "Unable to connect to JACK server\n");
+    TakePendingVoices(S);
+    audio_voice_list* Voices = S->Voices;
+
+    uint32_t Filled = 0;
+    for (int VoiceIndex = 0; VoiceIndex < Voices->Count; VoiceIndex++) {
+        audio_channel* Ch = Voices->Channels[VoiceIndex];
+        const bool Audible = VoiceIndex < Voices->AudibleCount;
+        const bool WasPlaying = Ch->Clock.Reading.Playing;
+        uint32_t Played = MixChannel(Ch, Audible, OutLeft, OutRight,
+            &Filled, NumFrames, CycleFrameTime);
+
+        // Running dry only counts once a channel has started,
+        // not while it waits for its first block
+        if (Played < NumFrames && (Played || WasPlaying)) {
+            BumpCounter(&Ch->Counters.StarvedPeriods, 1);
+            BumpCounter(&Ch->Counters.UnderrunFrames, NumFrames - Played);
         }
+        if (!Played && WasPlaying) {
+            PublishAudioClock(Ch, (audio_clock_reading){ .Playing = false });
+        }
+    }
+
+    // Silence wherever no channel played
+    ClearStereo(OutLeft + Filled, OutRight + Filled, NumFrames - Filled);
+
+    RecordCycle(S, NumFrames, GetMixerMicros() - CycleStart);
+}
+
+void RecordAudioXrun(audio_state* S) {
+    atomic_fetch_add_explicit(&S->Counters.Xruns, 1, memory_order_relaxed);
+}
+
+bool AudioHasVoices(audio_state* S) {
+    TakePendingVoices(S);
+    return S->Voices->Count > 0;
+}
+
+bool AudioChannelsHaveFrames(audio_state* S, uint32_t NumFrames) {
+    TakePendingVoices(S);
+    audio_voice_list* Voices = S->Voices;
+    if (Voices->Count == 0) {
         return false;
     }
-    if (Status & JackServerStarted) {
-        fprintf(stderr, "JACK server started\n");
+
+    for (int VoiceIndex = 0; VoiceIndex < Voices->Count; VoiceIndex++) {
+        audio_channel* Ch = Voices->Channels[VoiceIndex];
+        // Blocks are committed after their samples, so this can only undercount
+        ring_buffer_size_t Queued = GetRingBufferReadAvailable(&Ch->Samples);
+        if (Queued < (ring_buffer_size_t)NumFrames) {
+            return false;
+        }
     }
+    return true;
+}
+
+static audio_voice_list* AllocVoiceList(int Capacity) {
+    return calloc(1, sizeof(audio_voice_list) + Capacity * sizeof(audio_channel*));
+}
 
-    if (Status & JackNameNotUnique) {
-        ClientName = jack_get_client_name(AudioState->Client);
-        fprintf(stderr, "unique name `%s' assigned\n", ClientName);
+static void FreeRetiredVoices(audio_state* AudioState) {
+    audio_voice_list* Retired;
+    while (ReadRingBuffer(&AudioState->RetiredVoices, &Retired, 1)) {
+        free(Retired);
     }
+}
 
+// Whether A should get a voice before B
+static bool OutranksChannel(audio_channel* A, audio_channel* B) {
+    const bool AudibleA = atomic_load_explicit(&A->Gain, memory_order_relaxed) != 0;
+    const bool AudibleB = atomic_load_explicit(&B->Gain, memory_order_relaxed) != 0;
+    if (AudibleA != AudibleB) return AudibleA;
+    if (A->Priority != B->Priority) return A->Priority > B->Priority;
+    return A->HandedOutAt < B->HandedOutAt;
+}
 
-    jack_set_process_callback(AudioState->Client, AudioThreadCallback, (void*)AudioState);
-    // jack_on_shutdown(client, jack_shutdown, 0);
+// Ranks the channels in use and hands the mixer a new list.
+// Call with VoiceMutex held.
+static void PublishVoices(audio_state* AudioState) {
+    audio_voice_list* Voices = AllocVoiceList(AudioState->NumChannels);
 
-    printf("engine sample rate: %" PRIu32 "\n",
-        jack_get_sample_rate(AudioState->Client));
+    for (int ChannelIndex = 0; ChannelIndex < AudioState->NumChannels; ChannelIndex++) {
+        audio_channel* Ch = AudioState->Channels[ChannelIndex];
+        if (!Ch->InUse) continue;
 
-    AudioState->OutputPortLeft = jack_port_register(AudioState->Client,  "output_left",
-                      JACK_DEFAULT_AUDIO_TYPE,
-                      JackPortIsOutput|JackPortIsTerminal, 0);
-    AudioState->OutputPortRight = jack_port_register(AudioState->Client, "output_right",
-                      JACK_DEFAULT_AUDIO_TYPE,
-                      JackPortIsOutput|JackPortIsTerminal, 0);
+        // Insertion sort, lists are short and rebuilt rarely
+        int Slot = Voices->Count++;
+        while (Slot > 0 && OutranksChannel(Ch, Voices->Channels[Slot - 1])) {
+            Voices->Channels[Slot] = Voices->Channels[Slot - 1];
+            Slot--;
+        }
+        Voices->Channels[Slot] = Ch;
+    }
 
-    if (AudioState->OutputPortLeft == NULL || AudioState->OutputPortRight == NULL) {
-        fprintf(stderr, "no more JACK ports available\n");
-        return false;
+    int Audible = 0;
+    while (Audible < Voices->Count &&
+        atomic_load_explicit(&Voices->Channels[Audible]->Gain, memory_order_relaxed) != 0) {
+        Audible++;
+    }
+    if (Audible > AudioState->MaxVoices) {
+        Audible = AudioState->MaxVoices;
+    }
+    Voices->AudibleCount = Audible;
+
+    for (int VoiceIndex = 0; VoiceIndex < Voices->Count; VoiceIndex++) {
+        audio_channel* Ch = Voices->Channels[VoiceIndex];
+        const bool HasVoice = VoiceIndex < Audible;
+        if (Ch->HasVoice && !HasVoice &&
+            atomic_load_explicit(&Ch->Gain, memory_order_relaxed) != 0) {
+            AudioState->VoicesStolen++;
+        }
+        Ch->HasVoice = HasVoice;
     }
 
-    if (jack_activate(AudioState->Client)) {
-        fprintf(stderr, "cannot activate client");
-        return false;
+    // The mixer never took the last list if it's still here
+    audio_voice_list* Unused = atomic_exchange_explicit(&AudioState->PendingVoices, Voices,
+        memory_order_release);
+    free(Unused);
+    FreeRetiredVoices(AudioState);
+}
+
+static audio_channel* CreateAudioChannel() {
+    audio_channel* Ch = calloc(1, sizeof(audio_channel));
+    CreateRingBuffer(&Ch->Samples, sizeof(float) * 2, CHANNEL_FRAMES);
+    CreateRingBuffer(&Ch->BlocksIn, sizeof(audio_block), AUDIO_QUEUE);
+    atomic_init(&Ch->Gain, 1.0f);
+    return Ch;
+}
+
+int GetNextChannel(audio_state* AudioState) {
+    pthread_mutex_lock(&AudioState->VoiceMutex);
+
+    // Reuse a released channel before allocating another
+    int Next = -1;
+    for (int ChannelIndex = 0; ChannelIndex < AudioState->NumChannels; ChannelIndex++) {
+        if (!AudioState->Channels[ChannelIndex]->InUse) {
+            Next = ChannelIndex;
+            break;
+        }
+    }
+    if (Next == -1 && AudioState->NumChannels < AudioState->MaxChannels) {
+        Next = AudioState->NumChannels;
+        AudioState->Channels[Next] = CreateAudioChannel();
+        AudioState->NumChannels++;
+    }
+
+    if (Next != -1) {
+        audio_channel* Ch = AudioState->Channels[Next];
+        Ch->InUse       = true;
+        Ch->HasVoice    = false;
+        Ch->Priority    = 0;
+        Ch->HandedOutAt = AudioState->ChannelsHandedOut++;
+        atomic_store_explicit(&Ch->Gain, 1.0f, memory_order_relaxed);
+        PublishVoices(AudioState);
+    }
+
+    pthread_mutex_unlock(&AudioState->VoiceMutex);
+    return Next;
+}
+
+void ReleaseAudioChannel(audio_state* AudioState, int Channel) {
+    pthread_mutex_lock(&AudioState->VoiceMutex);
+    AudioState->Channels[Channel]->InUse = false;
+    PublishVoices(AudioState);
+    pthread_mutex_unlock(&AudioState->VoiceMutex);
+
+    // Whoever gets the channel next shouldn't hear what's left in it
+    FlushAudioChannel(AudioState, Channel);
+}
+
+void SetAudioChannelGain(audio_state* AudioState, int Channel, float Gain) {
+    audio_channel* Ch = AudioState->Channels[Channel];
+    pthread_mutex_lock(&AudioState->VoiceMutex);
+    float Previous = atomic_exchange_explicit(&Ch->Gain, Gain, memory_order_relaxed);
+    // Only going silent or audible changes who gets a voice
+    if ((Previous == 0) != (Gain == 0)) {
+        PublishVoices(AudioState);
     }
+    pthread_mutex_unlock(&AudioState->VoiceMutex);
+}
+
+void SetAudioChannelPriority(audio_state* AudioState, int Channel, int Priority) {
+    audio_channel* Ch = AudioState->Channels[Channel];
+    pthread_mutex_lock(&AudioState->VoiceMutex);
+    if (Ch->Priority != Priority) {
+        Ch->Priority = Priority;
+        PublishVoices(AudioState);
+    }
+    pthread_mutex_unlock(&AudioState->VoiceMutex);
+}
 
-    // "Input" here meaning we are "Inputting to JACK",
-    Ports = jack_get_ports(AudioState->Client, NULL, NULL, JackPortIsPhysical|JackPortIsInput);
-    if (Ports == NULL) {
-        fprintf(stderr, "no physical playback ports\n");
+int GetAudioChannelEpoch(audio_state* AudioState, int Channel) {
+    return atomic_load(&AudioState->Channels[Channel]->Epoch);
+}
+
+bool GetAudioChannelWriteRegions(audio_state* AudioState, int Channel, int Count,
+    float** Region1, int* Size1,
+    float** Region2, int* Size2) {
+
+    audio_channel* Ch = AudioState->Channels[Channel];
+    if (GetRingBufferWriteAvailable(&Ch->BlocksIn) < 1 ||
+        GetRingBufferWriteAvailable(&Ch->Samples) < Count) {
         return false;
     }
 
-    if (jack_connect(AudioState->Client, jack_port_name(AudioState->OutputPortLeft), Ports[0])
-        || jack_connect(AudioState->Client, jack_port_name(AudioState->OutputPortRight), Ports[1])) {
-        fprintf(stderr, "cannot connect output ports\n");
-        free(Ports);
+    void* Data1;
+    void* Data2;
+    ring_buffer_size_t RegionSize1, RegionSize2;
+    GetRingBufferWriteRegions(&Ch->Samples, Count,
+        &Data1, &RegionSize1, &Data2, &RegionSize2);
+    *Region1 = Data1;
+    *Size1   = RegionSize1;
+    *Region2 = Data2;
+    *Size2   = RegionSize2;
+    return true;
+}
+
+void CommitAudioChannelWrite(audio_state* AudioState, int Channel, int Count,
+    double PTS, double SampleDuration, int Epoch) {
+
+    audio_channel* Ch = AudioState->Channels[Channel];
+    AdvanceRingBufferWriteIndex(&Ch->Samples, Count);
+
+    audio_block Block = {
+        .Length          = Count,
+        .NextSampleIndex = 0,
+        .PTS             = PTS,
+        .SampleDuration  = SampleDuration,
+        .Epoch           = Epoch
+    };
+    WriteRingBuffer(&Ch->BlocksIn, &Block, 1);
+    atomic_fetch_add_explicit(&Ch->Counters.BlocksQueued, 1, memory_order_relaxed);
+}
+
+void FlushAudioChannel(audio_state* AudioState, int Channel) {
+    atomic_fetch_add(&AudioState->Channels[Channel]->Epoch, 1);
+}
+
+void GetAudioStats(audio_state* AudioState, audio_stats* Stats) {
+    audio_counters* Counters = &AudioState->Counters;
+
+    Stats->Cycles = atomic_load_explicit(&Counters->Cycles, memory_order_relaxed);
+    Stats->Xruns  = atomic_load_explicit(&Counters->Xruns,  memory_order_relaxed);
+    for (int Bucket = 0; Bucket < AUDIO_LOAD_BUCKETS; Bucket++) {
+        Stats->LoadHistogram[Bucket] =
+            atomic_load_explicit(&Counters->LoadHistogram[Bucket], memory_order_relaxed);
+    }
+    Stats->MaxLoad = atomic_load_explicit(&Counters->MaxLoadPermille, memory_order_relaxed) / 1000.0;
+    Stats->MaxCycleSeconds =
+        atomic_load_explicit(&Counters->MaxCycleMicros, memory_order_relaxed) / 1000000.0;
+
+    pthread_mutex_lock(&AudioState->VoiceMutex);
+    Stats->ChannelsInUse = 0;
+    int Audible = 0;
+    for (int ChannelIndex = 0; ChannelIndex < AudioState->NumChannels; ChannelIndex++) {
+        audio_channel* Ch = AudioState->Channels[ChannelIndex];
+        if (!Ch->InUse) continue;
+        Stats->ChannelsInUse++;
+        if (atomic_load_explicit(&Ch->Gain, memory_order_relaxed) != 0) Audible++;
+    }
+    Stats->AudibleVoices = Audible < AudioState->MaxVoices ? Audible : AudioState->MaxVoices;
+    Stats->VoicesStolen = AudioState->VoicesStolen;
+    pthread_mutex_unlock(&AudioState->VoiceMutex);
+}
+
+bool GetAudioChannelStats(audio_state* AudioState, int Channel, audio_channel_stats* Stats) {
+    pthread_mutex_lock(&AudioState->VoiceMutex);
+    audio_channel* Ch = Channel < AudioState->NumChannels ? AudioState->Channels[Channel] : NULL;
+    pthread_mutex_unlock(&AudioState->VoiceMutex);
+    if (!Ch) return false;
+
+    Stats->StarvedPeriods =
+        atomic_load_explicit(&Ch->Counters.StarvedPeriods, memory_order_relaxed);
+    Stats->UnderrunFrames =
+        atomic_load_explicit(&Ch->Counters.UnderrunFrames, memory_order_relaxed);
+    Stats->BlocksQueued =
+        atomic_load_explicit(&Ch->Counters.BlocksQueued, memory_order_relaxed);
+    Stats->QueuedBlocks = GetRingBufferReadAvailable(&Ch->BlocksIn);
+    Stats->QueuedFrames = GetRingBufferReadAvailable(&Ch->Samples);
+    return true;
+}
+
+void PrintAudioStats(audio_state* AudioState) {
+    if (!AudioState) return;
+
+    audio_stats Stats;
+    GetAudioStats(AudioState, &Stats);
+
+    printf("Audio (%s): %u cycles, %u xruns, max cycle %.3fms (%.0f%% of a period), "
+        "%i channels in use, %i audible of %i voices, %u voices stolen\n",
+        AudioState->Backend->Name,
+        Stats.Cycles, Stats.Xruns,
+        Stats.MaxCycleSeconds * 1000.0, Stats.MaxLoad * 100.0,
+        Stats.ChannelsInUse, Stats.AudibleVoices, AudioState->MaxVoices,
+        Stats.VoicesStolen);
+
+    printf("  load:");
+    for (int Bucket = 0; Bucket < AUDIO_LOAD_BUCKETS; Bucket++) {
+        if (Bucket == AUDIO_LOAD_BUCKETS - 1) {
+            printf(" over:%u", Stats.LoadHistogram[Bucket]);
+        } else {
+            printf(" <%i%%:%u", (Bucket + 1) * 10, Stats.LoadHistogram[Bucket]);
+        }
+    }
+    printf("\n");
+
+    audio_channel_stats Channel;
+    for (int ChannelIndex = 0; GetAudioChannelStats(AudioState, ChannelIndex, &Channel); ChannelIndex++) {
+        if (!Channel.BlocksQueued) continue;
+        printf("  channel %i: %u blocks queued, %u starved cycles, %u frames underrun\n",
+            ChannelIndex, Channel.BlocksQueued,
+            Channel.StarvedPeriods, Channel.UnderrunFrames);
+    }
+}
+
+bool GetAudioChannelTime(audio_state* AudioState, int Channel, double* Time) {
+    audio_channel* Ch = AudioState->Channels[Channel];
+
+    audio_clock_reading Reading;
+    unsigned Sequence;
+    do {
+        Sequence = atomic_load_explicit(&Ch->Clock.Sequence, memory_order_acquire);
+        Reading = Ch->Clock.Reading;
+        atomic_thread_fence(memory_order_acquire);
+    } while ((Sequence & 1) ||
+        Sequence != atomic_load_explicit(&Ch->Clock.Sequence, memory_order_relaxed));
+
+    if (!Reading.Playing || Reading.Epoch != atomic_load(&Ch->Epoch)) {
         return false;
     }
 
-    free(Ports);
+    // Extrapolate from when that sample reached the speakers.
+    // The difference is signed so it survives frame time wraparound,
+    // and is negative while the sample is still in the output latency.
+    uint32_t HeardAt = Reading.FrameTime + AudioState->OutputLatency;
+    int32_t FramesSince = (int32_t)(AudioState->Backend->GetFrameTime(AudioState) - HeardAt);
+    *Time = Reading.PTS + FramesSince * Reading.SampleDuration;
     return true;
 }
 
-audio_state* StartAudio() {
+static void FreeAudioChannels(audio_state* AudioState) {
+    for (int ChannelIndex = 0; ChannelIndex < AudioState->NumChannels; ChannelIndex++) {
+        audio_channel* Ch = AudioState->Channels[ChannelIndex];
+        FreeRingBuffer(&Ch->Samples);
+        FreeRingBuffer(&Ch->BlocksIn);
+        free(Ch);
+    }
 
-    audio_state* AudioState = calloc(1, sizeof(audio_state));
+    FreeRetiredVoices(AudioState);
+    FreeRingBuffer(&AudioState->RetiredVoices);
+    free(atomic_load(&AudioState->PendingVoices));
+    free(AudioState->Voices);
+    pthread_mutex_destroy(&AudioState->VoiceMutex);
+}
 
-    const int RingBufSize = AUDIO_QUEUE; // Size must be power of 2
+audio_state* StartAudio(const audio_options* Options) {
 
-    for (int ChannelIndex = 0; ChannelIndex < NUM_CHANNELS; ChannelIndex++) {
-        audio_channel* Ch = &AudioState->Channels[ChannelIndex];
-        CreateRingBuffer(&Ch->BlocksIn, sizeof(audio_block), RingBufSize);
+    audio_options Defaults = *Options;
+    if (!Defaults.SampleRate) Defaults.SampleRate = SAMPLE_RATE;
+    if (!Defaults.BlockSize)  Defaults.BlockSize  = BLOCK_SIZE;
+    if (Defaults.MaxChannels <= 0 || Defaults.MaxChannels > MAX_CHANNELS) {
+        Defaults.MaxChannels = MAX_CHANNELS;
     }
+    if (Defaults.MaxVoices <= 0) Defaults.MaxVoices = MAX_VOICES;
 
-    bool JackStarted = StartJack(AudioState);
-    if (!JackStarted) {
+    audio_state* AudioState = calloc(1, sizeof(audio_state));
+    AudioState->MaxChannels = Defaults.MaxChannels;
+    AudioState->MaxVoices   = Defaults.MaxVoices;
+    pthread_mutex_init(&AudioState->VoiceMutex, NULL);
+
+    // The mixer starts with an empty list, so it never has to check for one
+    AudioState->Voices = AllocVoiceList(0);
+    atomic_init(&AudioState->PendingVoices, NULL);
+    CreateRingBuffer(&AudioState->RetiredVoices, sizeof(audio_voice_list*), 4);
+
+    switch (Defaults.Backend) {
+        case AUDIO_BACKEND_JACK: AudioState->Backend = &JackAudioBackend; break;
+        case AUDIO_BACKEND_NULL: AudioState->Backend = &NullAudioBackend; break;
+    }
+
+    if (!AudioState->Backend->Start(AudioState, &Defaults)) {
+        FreeAudioChannels(AudioState);
         free(AudioState);
         return NULL;
     }
 
     return AudioState;
 }
+
+void StopAudio(audio_state* AudioState) {
+    if (!AudioState) return;
+
+    // Stops the mixer before its channels go away
+    AudioState->Backend->Stop(AudioState);
+    FreeAudioChannels(AudioState);
+    free(AudioState);
+}
@@ -2,38 +2,204 @@
 #define VIDEO_AUDIO_H
 
 #include "ringbuffer.h"
-#include <jack/jack.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #define SAMPLE_RATE 44100
 #define BLOCK_SIZE 128
 
-#define AUDIO_QUEUE 16 // must be power of 2
+#define AUDIO_QUEUE 64 // Blocks per channel, must be power of 2
 
-#define NUM_CHANNELS 16
+#define CHANNEL_FRAMES 32768 // Stereo frames per channel, must be power of 2
 
+#define MAX_CHANNELS 256 // Channels that can be handed out at once
+#define MAX_VOICES 32    // Channels mixed at once, the rest are kept in time silently
+
+// Mixer cycles are binned by how much of their period they took,
+// 10% a bucket, with the last bucket for cycles that overran it
+#define AUDIO_LOAD_BUCKETS 11
+
+// Describes the next Length frames in the channel's sample ring,
+// which came from one decoded frame.
 typedef struct {
-    float* Samples;
     int Length;
-    int NextSampleIndex;
+    int NextSampleIndex;   // Only touched by the mixer
+    double PTS;            // Media time of the block's first frame
+    double SampleDuration; // Media time per frame
+    int Epoch;             // Blocks from before the channel's last flush are skipped
 } audio_block;
 
+// Where a channel's playback was at the start of the last mixer cycle
+typedef struct {
+    bool Playing;
+    int Epoch;
+    double PTS;               // Media time of the first sample played that cycle
+    double SampleDuration;
+    uint32_t FrameTime;       // Backend frame time that sample went out at
+} audio_clock_reading;
+
+// Written by the mixer, read from any thread.
+// Sequence is odd while a write is in progress.
+typedef struct {
+    atomic_uint Sequence;
+    audio_clock_reading Reading;
+} audio_clock;
+
+// Written by the mixer, except BlocksQueued which the channel's
+// writer bumps. Only ever read through GetAudioStats.
+typedef struct {
+    atomic_uint StarvedPeriods; // Cycles the channel ran dry partway through
+    atomic_uint UnderrunFrames; // Frames of those cycles left silent
+    atomic_uint BlocksQueued;
+} audio_channel_counters;
+
+// Written by the mixer, and Xruns by the backend
+typedef struct {
+    atomic_uint Cycles;
+    atomic_uint Xruns;
+    atomic_uint LoadHistogram[AUDIO_LOAD_BUCKETS];
+    atomic_uint MaxLoadPermille;
+    atomic_uint MaxCycleMicros;
+} audio_counters;
+
+// Samples are written before the block describing them,
+// so the callback always finds a block's samples in the ring.
+// Neither side allocates.
 typedef struct {
-    ringbuffer BlocksIn;
-    int ReadBlockIndex;
-    int WriteBlockIndex;
-    audio_block Blocks[AUDIO_QUEUE];
+    ringbuffer Samples;       // Interleaved stereo float frames at the engine's rate
+    ringbuffer BlocksIn;      // audio_block
+    audio_block CurrentBlock; // Being played, callback only
+    atomic_int Epoch;
+    _Atomic float Gain;
+    audio_clock Clock;
+    audio_channel_counters Counters;
+
+    // Guarded by the state's VoiceMutex
+    bool InUse;
+    bool HasVoice;        // Mixed in the last list published
+    int Priority;
+    uint64_t HandedOutAt; // Older channels keep their voice on ties
 } audio_channel;
 
+// What the mixer plays. The first AudibleCount channels are mixed,
+// the rest only have their samples consumed so their clocks keep running.
+// Built off the mixer thread and never changed once handed over.
+typedef struct {
+    int Count;
+    int AudibleCount;
+    audio_channel* Channels[];
+} audio_voice_list;
+
+typedef enum {
+    AUDIO_BACKEND_JACK,
+    AUDIO_BACKEND_NULL  // No device, see audio-null.c
+} audio_backend_type;
+
 typedef struct {
-    audio_channel Channels[NUM_CHANNELS];
-    int NextChannel;
-    jack_port_t *OutputPortLeft;
-    jack_port_t *OutputPortRight;
-    jack_client_t *Client;
+    audio_backend_type Backend;
+    int SampleRate;      // Null backend only, JACK uses the server's
+    int BlockSize;       // Null backend only
+    bool Lockstep;       // Null backend: mix as fast as the decoders keep up
+    const char* WavPath; // Null backend: write the mix here if set
+    int MaxChannels;     // Up to MAX_CHANNELS
+    int MaxVoices;       // Audible channels, lower priority ones are stolen from
+} audio_options;
+
+typedef struct audio_backend audio_backend;
+
+typedef struct {
+    // Channels are allocated the first time they're needed,
+    // and kept for reuse once released
+    audio_channel* Channels[MAX_CHANNELS];
+    int NumChannels;
+    int MaxChannels;
+    int MaxVoices;
+    uint64_t ChannelsHandedOut;
+    unsigned VoicesStolen;
+    pthread_mutex_t VoiceMutex; // Held by threads changing channels, never the mixer
+
+    // A new voice list is swapped into PendingVoices, and the mixer
+    // takes it at the start of a cycle. Lists it's done with come
+    // back through RetiredVoices to be freed off the mixer thread.
+    _Atomic(audio_voice_list*) PendingVoices;
+    ringbuffer RetiredVoices;   // audio_voice_list*
+    audio_voice_list* Voices;   // Mixer only
+
+    const audio_backend* Backend;
+    void* BackendData;
+    uint32_t OutputLatency;     // Frames between a cycle and it being heard
+    int SampleRate;
+    audio_counters Counters;
 } audio_state;
 
-audio_state* StartAudio();
+typedef struct {
+    unsigned StarvedPeriods;
+    unsigned UnderrunFrames;
+    unsigned BlocksQueued;
+    int QueuedBlocks;   // Waiting in the channel right now
+    int QueuedFrames;
+} audio_channel_stats;
+
+// A copy of the counters, taken without stopping the mixer
+typedef struct {
+    unsigned Cycles;
+    unsigned Xruns;
+    unsigned LoadHistogram[AUDIO_LOAD_BUCKETS];
+    double MaxLoad;      // Largest fraction of a period one cycle took
+    double MaxCycleSeconds;
+    int ChannelsInUse;
+    int AudibleVoices;
+    unsigned VoicesStolen;
+} audio_stats;
+
+// Fills in defaults for anything in Options left zero.
+// Returns NULL if the backend couldn't be started.
+audio_state* StartAudio(const audio_options* Options);
 
+void StopAudio(audio_state* AudioState);
+
+// Returns -1 if MaxChannels are already handed out.
 int GetNextChannel(audio_state* AudioState);
 
+// Stops the mixer looking at the channel until it's handed out again.
+void ReleaseAudioChannel(audio_state* AudioState, int Channel);
+
+// A silent channel never takes a voice from an audible one.
+void SetAudioChannelGain(audio_state* AudioState, int Channel, float Gain);
+
+// When more than MaxVoices channels are audible, the highest priority
+// ones are mixed. The rest keep time without being heard.
+void SetAudioChannelPriority(audio_state* AudioState, int Channel, int Priority);
+
+// Blocks should be tagged with the epoch read before
+// their frame was taken from the decoder.
+int GetAudioChannelEpoch(audio_state* AudioState, int Channel);
+
+// Gets up to two regions of the channel's sample ring to write Count
+// interleaved stereo frames into. Sizes are in frames.
+// Returns false if there isn't room for them all.
+bool GetAudioChannelWriteRegions(audio_state* AudioState, int Channel, int Count,
+    float** Region1, int* Size1,
+    float** Region2, int* Size2);
+
+// Hands Count frames written to the regions to the callback.
+void CommitAudioChannelWrite(audio_state* AudioState, int Channel, int Count,
+    double PTS, double SampleDuration, int Epoch);
+
+// Makes the mixer skip everything queued on the channel so far.
+void FlushAudioChannel(audio_state* AudioState, int Channel);
+
+void GetAudioStats(audio_state* AudioState, audio_stats* Stats);
+
+// Returns false if the channel has never been handed out.
+bool GetAudioChannelStats(audio_state* AudioState, int Channel, audio_channel_stats* Stats);
+
+void PrintAudioStats(audio_state* AudioState);
+
+// Gets the media time being heard right now on the channel.
+// Returns false if the channel isn't playing anything.
+bool GetAudioChannelTime(audio_state* AudioState, int Channel, double* Time);
+
 #endif // VIDEO_AUDIO_H
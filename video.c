@@ -1,275 +1,1817 @@
 #include "video.h"
 #include "utils.h"
 #include "texture.h"
-#define NANOVG_GL3
-#include "nanovg_gl.h"
+#include <libavutil/pixdesc.h>
 #include "video-audio.h"
+#include "keyframe-index.h"
 #include <pthread.h>
 #include <assert.h>
+#include <math.h>
+#include <limits.h>
 
 #define FRAME_BUFFER_SIZE 128 // Must be power of 2
 #define HALF_FRAME_BUFFER_SIZE (FRAME_BUFFER_SIZE / 2)
 
-void DecodeVideo(video* Video);
+#define PACKET_QUEUE_SIZE 256 // Must be power of 2
+
+// A decoder that fails to reopen is retried after at most 2^this keyframes
+#define MAX_REOPEN_BACKOFF 6
+
+// Bilinear sampling of level 0 starts to alias past about 2:1
+#define MIPMAP_MINIFICATION_THRESHOLD 2.0
+
+// Most times a picture is halved to fit its size on screen
+#define MAX_REDUCTION_LEVEL 3
+
+// Recycled frames and packets flow back to the threads that fill them.
+// The free lists have room for twice what we preallocate, since a
+// packet taken from one stream's list may be returned to the other's.
+#define FRAME_POOL_SIZE FRAME_BUFFER_SIZE
+#define PACKET_POOL_SIZE PACKET_QUEUE_SIZE
+
+// Decode threads fill their frame ring up to the high watermark,
+// then sleep until the consumer has drained it to the low watermark,
+// so they wake once per batch of frames rather than once per frame.
+// Video streams take their high watermark from the frame budget,
+// and this is the most it can give them.
+#define FRAME_HIGH_WATERMARK HALF_FRAME_BUFFER_SIZE
+
+// The demux thread sleeps on a full packet queue until it is half empty.
+#define PACKET_LOW_WATERMARK (PACKET_QUEUE_SIZE / 2)
+
+// Shortest sleep while waiting for an audio frame's presentation time
+#define MIN_AUDIO_WAIT_SECONDS 0.001
+
+// How often a full audio channel is checked for room.
+// Well under the CHANNEL_SAMPLES of audio it holds.
+#define AUDIO_REFILL_WAIT_SECONDS 0.005
+
+// How far behind the clock a video packet can be before the decoder
+// stops decoding frames nothing references, and then everything but
+// keyframes. It goes back to decoding everything once it's caught up.
+#define LATE_SKIP_NONREF_SECONDS 0.05
+#define LATE_SKIP_NONKEY_SECONDS 0.5
+
+// Markers written into the packet and frame queues when a seek happens.
+// Only their addresses are used.
+static AVPacket FlushPacket;
+static AVFrame  FlushFrame;
+
+// Written into the packet queues where the demuxer looped back.
+// Decoders drain and flush there, then carry on.
+static AVPacket LoopPacket;
+
+bool DemuxNextPacket(video* Video);
+bool DecodeNextPacket(video* Video, stream* Stream);
+void UpdateLateSkipping(video* Video, stream* Stream, AVPacket* Packet);
+void ResolveLateSkippedPacket(stream* Stream, AVFrame* Frame);
+void SettleLateSkippedPackets(stream* Stream, bool Skipped);
+void SetVideoOutputSize(video* Video, int Width, int Height);
+double GetTimeUntilNextFrame(video* Video, stream* Stream, double DisplayLead);
+void CreateFramePool(stream* Stream);
+void RecycleFrame(stream* Stream, AVFrame* Frame);
+bool QueueAudioFrame(AVFrame* Frame, video* Video, int Epoch);
+uint64_t GetChannelLayout(uint64_t Layout, int Channels);
+bool ConfigureResampler(stream* Stream, audio_state* AudioState,
+    uint64_t Layout, int Format, int Rate);
+bool DiscardFlushedFrames(stream* Stream);
+void ConsumeFrames(stream* Stream, ring_buffer_size_t Count);
+void ConsumePackets(video* Video, stream* Stream, ring_buffer_size_t Count);
+void RecyclePacket(stream* Stream, AVPacket* Packet);
+void GetCurrentFrame(video* Video, stream* Stream, double DisplayLead, AVFrame** Frame);
 
 double GetFramePTS(AVFrame* Frame, stream* Stream);
 double GetVideoFrameDuration(video* Video);
 double GetVideoTime(video* Video);
-void SeekVideo(video* Video, double Timestamp);
+double GetVideoFileTime(video* Video);
+double GetFileTime(video* Video, double Time);
+double GetNominalFrameDuration(stream* Stream);
+bool CacheVideoFrame(video* Video, AVFrame* Frame);
+void AbandonFrameCache(video* Video);
+bool TickCachedVideo(video* Video, double DisplayLead);
+double GetTimeUntilNextCachedFrame(video* Video, double DisplayLead);
+void FinishSeek(video* Video, stream* Stream);
+
+// How many times the decoder itself can halve the picture, if it can at all.
+int GetDecoderLowres(stream* Stream) {
+    int Reduction = atomic_load(&Stream->WantedReduction);
+    return MIN(Reduction, Stream->Codec->max_lowres);
+}
+
+// Deblocking barely shows on a shrunk picture, and is a good part of
+// what decoding costs. Skipping it on frames nothing references is free
+// of drift, and once a picture's a quarter size or less it's skipped
+// everywhere.
+enum AVDiscard GetLoopFilterDiscard(stream* Stream) {
+    int Reduction = atomic_load(&Stream->WantedReduction);
+    if (Reduction >= 2) return AVDISCARD_ALL;
+    if (Reduction == 1) return AVDISCARD_NONREF;
+    return AVDISCARD_DEFAULT;
+}
+
+// Allocates and opens a fresh decoder context for the stream,
+// decoding with the given number of threads.
+bool OpenCodecContext(stream* Stream, int ThreadCount) {
+    int Result = 0;
+
+    AVCodecContext* CodecContext = avcodec_alloc_context3(Stream->Codec);
+    if (CodecContext == NULL) {
+        av_log(NULL, AV_LOG_ERROR, "Can't allocate decoder context\n");
+        // AVERROR(ENOMEM);
+        return false;
+    }
 
-void DecodeNextFrame(video* Video);
+    Result = avcodec_parameters_to_context(CodecContext, Stream->Stream->codecpar);
+    if (Result) {
+        av_log(NULL, AV_LOG_ERROR, "Can't copy decoder context\n");
+        avcodec_free_context(&CodecContext);
+        return false;
+    }
 
-double GetTimeInSeconds() {
-    return (double)GetTimeInMicros() / 1000000.0;
+    CodecContext->thread_count = ThreadCount;
+    CodecContext->thread_type  = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+    const int Lowres = GetDecoderLowres(Stream);
+    CodecContext->lowres           = Lowres;
+    CodecContext->skip_loop_filter = GetLoopFilterDiscard(Stream);
+
+    Result = avcodec_open2(CodecContext, Stream->Codec, NULL);
+    if (Result < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Can't open decoder\n");
+        avcodec_free_context(&CodecContext);
+        return false;
+    }
+
+    Stream->CodecContext = CodecContext;
+    Stream->ThreadCount  = ThreadCount;
+    Stream->Lowres       = Lowres;
+    return true;
 }
 
+// Finds the stream's decoder, and opens it unless OpenDecoder is false,
+// in which case the stream's decode thread opens it when it's first needed.
 void OpenCodec(
     enum AVMediaType MediaType,
     AVFormatContext* FormatContext,
-    stream* Stream)
+    stream* Stream,
+    bool OpenDecoder)
 {
-    int Result = 0;
-
     Stream->Index = av_find_best_stream(FormatContext, MediaType, -1, -1, NULL, 0);
     if (Stream->Index < 0) {
         av_log(NULL, AV_LOG_ERROR, "Can't find stream in input file\n");
         return;
     }
 
-    Stream->Stream = FormatContext->streams[Stream->Index];
+    Stream->Stream = FormatContext->streams[Stream->Index];
+
+    AVCodecParameters* CodecParams = Stream->Stream->codecpar;
+    Stream->Codec = avcodec_find_decoder(CodecParams->codec_id);
+    if (Stream->Codec == NULL) {
+        av_log(NULL, AV_LOG_ERROR, "Can't find decoder\n");
+        return;
+    }
+
+    // Audio decoding is cheap enough to stay single-threaded;
+    // video decoders share the process-wide thread budget.
+    int ThreadCount = 1;
+    if (MediaType == AVMEDIA_TYPE_VIDEO) {
+        int64_t BitRate = CodecParams->bit_rate ? CodecParams->bit_rate : FormatContext->bit_rate;
+        double Weight = GetDecodeWeight(CodecParams->width, CodecParams->height,
+            av_q2d(Stream->Stream->avg_frame_rate), BitRate);
+        RegisterDecodeBudget(&Stream->Budget, Weight);
+        ThreadCount = GetDecodeBudgetThreads(&Stream->Budget);
+    }
+
+    if (OpenDecoder && !OpenCodecContext(Stream, ThreadCount)) {
+        UnregisterDecodeBudget(&Stream->Budget);
+        return;
+    }
+
+    Stream->Timebase = av_q2d(Stream->Stream->time_base);
+
+    Stream->Valid = true;
+}
+
+int ReceiveFrames(stream* Stream, int* NumFrames);
+
+// Drains the decoder and reopens it if the decode budget
+// has been rebalanced since it was opened, or it should
+// be decoding at another size for the display.
+// Only safe at a keyframe, since the new decoder has no references.
+void ApplyDecodeBudget(stream* Stream) {
+    if (!Stream->Budget.Registered) return;
+
+    Stream->CodecContext->skip_loop_filter = GetLoopFilterDiscard(Stream);
+
+    int ThreadCount = GetDecodeBudgetThreads(&Stream->Budget);
+    int Lowres = GetDecoderLowres(Stream);
+    if (ThreadCount == Stream->ThreadCount && Lowres == Stream->Lowres) return;
+
+    // Backing off after a failed reopen
+    if (Stream->KeyframesUntilReopen > 0) {
+        Stream->KeyframesUntilReopen--;
+        return;
+    }
+
+    // Everything the old decoder still holds has to fit in the frame
+    // ring, or it would be freed with frames in it. Frame threads and
+    // reordering bound what that is. Otherwise wait for a later keyframe.
+    const int HeldFrames = MIN(Stream->Stats.PacketsInFlight,
+        Stream->ThreadCount + Stream->CodecContext->has_b_frames);
+    // ReceiveFrames keeps one slot free, and needs another to see the end
+    if (GetRingBufferWriteAvailable(&Stream->Buffer) < HeldFrames + 2) return;
+
+    int NumFrames;
+    avcodec_send_packet(Stream->CodecContext, NULL);
+    ReceiveFrames(Stream, &NumFrames);
+    Stream->Stats.FramesReceived += NumFrames;
+    Stream->Stats.PacketsInFlight = 0;
+    SettleLateSkippedPackets(Stream, true);
+
+    AVCodecContext* OldCodecContext = Stream->CodecContext;
+    if (OpenCodecContext(Stream, ThreadCount)) {
+        avcodec_free_context(&OldCodecContext);
+        Stream->ReopenFailures = 0;
+    } else {
+        // Keep using the old decoder as it was opened, and try again
+        // after twice as many keyframes as last time
+        avcodec_flush_buffers(OldCodecContext);
+        Stream->KeyframesUntilReopen = 1 << MIN(Stream->ReopenFailures, MAX_REOPEN_BACKOFF);
+        Stream->ReopenFailures++;
+    }
+}
+
+void* DemuxThreadMain(void* Arg) {
+    video* Video = Arg;
+
+    while (!Video->StopDecodeThreads) {
+        if (!DemuxNextPacket(Video)) {
+            WaitWakeup(&Video->DemuxWakeup);
+        }
+    }
+    return NULL;
+}
+
+void* VideoDecodeThreadMain(void* Arg) {
+    video* Video = Arg;
+    stream* Stream = &Video->VideoStream;
+
+    while (!Video->StopDecodeThreads) {
+        if (atomic_load(&Video->FramesCached)) {
+            // Played from the cache from now on, so hand back the
+            // decoder's memory and its share of the budgets
+            avcodec_free_context(&Stream->CodecContext);
+            sws_freeContext(Stream->Scaler);
+            Stream->Scaler = NULL;
+            av_buffer_pool_uninit(&Stream->ScaledBuffers);
+            UnregisterDecodeBudget(&Stream->Budget);
+            UnregisterFrameBudget(&Stream->FrameBudget);
+            break;
+        }
+        if (!DecodeNextPacket(Video, Stream)) {
+            WaitWakeup(&Video->VideoStream.DecodeWakeup);
+        }
+    }
+    return NULL;
+}
+
+// With an audio engine, the audio is the master clock:
+// keep the channel topped up and let JACK pace playback.
+bool FeedAudioChannel(video* Video) {
+    stream* Stream = &Video->AudioStream;
+    bool DidWork = false;
+
+    while (true) {
+        // Read before taking the frame, so a seek in between
+        // gets the frame skipped rather than played
+        int Epoch = GetAudioChannelEpoch(Video->AudioState, Video->AudioChannel);
+
+        if (!DiscardFlushedFrames(Stream) ||
+            GetRingBufferReadAvailable(&Stream->Buffer) == 0) {
+            break;
+        }
+
+        AVFrame* AudioFrame = NULL;
+        PeekRingBuffer(&Stream->Buffer, &AudioFrame, 1);
+        if (AudioFrame == NULL) {
+            break; // A file that couldn't loop has ended
+        }
+
+        // Nothing is heard from a seek until the picture's there too
+        FinishSeek(Video, Stream);
+        if (IsMediaClockHeld(&Video->Clock)) {
+            break;
+        }
+
+        if (!QueueAudioFrame(AudioFrame, Video, Epoch)) {
+            break; // Channel's full
+        }
+        ConsumeFrames(Stream, 1);
+        RecycleFrame(Stream, AudioFrame);
+        DidWork = true;
+    }
+    return DidWork;
+}
+
+// While muted, throws away any audio read before the demuxer started
+// discarding it, passing seek markers on so flushes still balance.
+bool SkipAudio(video* Video) {
+    stream* Stream = &Video->AudioStream;
+    bool DidWork = false;
+
+    while (GetRingBufferReadAvailable(&Stream->Packets) > 0) {
+        AVPacket* Packet = NULL;
+        PeekRingBuffer(&Stream->Packets, &Packet, 1);
+        if (Packet == &FlushPacket) {
+            if (!DecodeNextPacket(Video, Stream)) {
+                break; // No room for the marker frame yet
+            }
+        } else {
+            ConsumePackets(Video, Stream, 1);
+            RecyclePacket(Stream, Packet);
+        }
+        DidWork = true;
+    }
+
+    while (GetRingBufferReadAvailable(&Stream->Buffer) > 0) {
+        AVFrame* Frame = NULL;
+        ReadRingBuffer(&Stream->Buffer, &Frame, 1);
+        if (Frame == &FlushFrame) {
+            atomic_fetch_sub(&Stream->PendingFrameFlushes, 1);
+        } else {
+            RecycleFrame(Stream, Frame);
+        }
+        DidWork = true;
+    }
+    return DidWork;
+}
+
+void* AudioDecodeThreadMain(void* Arg) {
+    video* Video = Arg;
+    stream* Stream = &Video->AudioStream;
+
+    while (!Video->StopDecodeThreads) {
+        if (atomic_load(&Video->AudioMuted)) {
+            if (!SkipAudio(Video)) {
+                WaitWakeup(&Stream->DecodeWakeup);
+            }
+            continue;
+        }
+
+        // Muted videos never open their decoder
+        if (!Stream->CodecContext && !OpenCodecContext(Stream, 1)) {
+            atomic_store(&Video->AudioMuted, true);
+            continue;
+        }
+
+        bool DidWork = DecodeNextPacket(Video, &Video->AudioStream);
+
+        if (Video->AudioState) {
+            DidWork |= FeedAudioChannel(Video);
+            if (!DidWork) {
+                TimedWaitWakeup(&Video->AudioStream.DecodeWakeup,
+                    AUDIO_REFILL_WAIT_SECONDS);
+            }
+            continue;
+        }
+
+        // No audio engine, so just keep time with the wall clock
+        AVFrame* AudioFrame = NULL;
+        GetCurrentFrame(Video, &Video->AudioStream, 0, &AudioFrame);
+        if (AudioFrame) {
+            RecycleFrame(&Video->AudioStream, AudioFrame);
+            DidWork = true;
+        }
+
+        if (!DidWork) {
+            // Sleep until the next frame is due, or until
+            // there are more packets or frames to work with.
+            double Wait = GetTimeUntilNextFrame(Video, &Video->AudioStream, 0);
+            if (Wait < 0) {
+                WaitWakeup(&Video->AudioStream.DecodeWakeup);
+            } else {
+                TimedWaitWakeup(&Video->AudioStream.DecodeWakeup,
+                    MAX(Wait, MIN_AUDIO_WAIT_SECONDS));
+            }
+        }
+    }
+    return NULL;
+}
+
+// Formats whose planes can be uploaded as they come out of the decoder
+bool IsShaderPixelFormat(enum AVPixelFormat Format) {
+    switch (Format) {
+        case AV_PIX_FMT_YUV420P:
+        case AV_PIX_FMT_YUV422P:
+        case AV_PIX_FMT_YUV444P:
+        case AV_PIX_FMT_YUVJ420P:
+        case AV_PIX_FMT_YUVJ422P:
+        case AV_PIX_FMT_YUVJ444P:
+            return true;
+        default:
+            return false;
+    }
+}
+
+void CreatePlaneTextures(video* Video) {
+    const bool Mipmapped = Video->Filter != VIDEO_FILTER_LINEAR;
+    const int LumaLevels   = Mipmapped ? GetMipLevelCount(Video->Width, Video->Height) : 1;
+    const int ChromaLevels = Mipmapped ? GetMipLevelCount(Video->ChromaWidth, Video->ChromaHeight) : 1;
+
+    Video->PlaneTextures[0] = CreateTextureArray(Video->Width, Video->Height, 1, 1, LumaLevels);
+    Video->PlaneTextures[1] = CreateTextureArray(Video->ChromaWidth, Video->ChromaHeight, 1, 1, ChromaLevels);
+    Video->PlaneTextures[2] = CreateTextureArray(Video->ChromaWidth, Video->ChromaHeight, 1, 1, ChromaLevels);
+
+    Video->PlaneLayer          = 0;
+    Video->PlaneLevels         = LumaLevels;
+    Video->LumaLayerWidth      = Video->Width;
+    Video->LumaLayerHeight     = Video->Height;
+    Video->ChromaLayerWidth    = Video->ChromaWidth;
+    Video->ChromaLayerHeight   = Video->ChromaHeight;
+    Video->SharesPlaneTextures = false;
+    Video->UsingMipmaps        = false;
+}
+
+// What frames of the decoded format are uploaded as
+enum AVPixelFormat GetPlanarFormat(enum AVPixelFormat DecodedFormat) {
+    if (IsShaderPixelFormat(DecodedFormat)) {
+        return DecodedFormat;
+    }
+    // Keep chroma subsampling for YUV sources; full chroma
+    // for everything else (RGB, paletted GIFs...)
+    const AVPixFmtDescriptor* Desc = av_pix_fmt_desc_get(DecodedFormat);
+    bool Subsampled = Desc && (Desc->flags & AV_PIX_FMT_FLAG_RGB) == 0 &&
+        (Desc->log2_chroma_w || Desc->log2_chroma_h);
+    return Subsampled ? AV_PIX_FMT_YUV420P : AV_PIX_FMT_YUV444P;
+}
+
+void CreateVideoTextures(video* Video) {
+    enum AVPixelFormat PlanarFormat = GetPlanarFormat(Video->VideoStream.CodecContext->pix_fmt);
+    Video->PlanarFormat = PlanarFormat;
+
+    const AVPixFmtDescriptor* PlanarDesc = av_pix_fmt_desc_get(PlanarFormat);
+    Video->ChromaWidth  = AV_CEIL_RSHIFT(Video->Width,  PlanarDesc->log2_chroma_w);
+    Video->ChromaHeight = AV_CEIL_RSHIFT(Video->Height, PlanarDesc->log2_chroma_h);
+
+    // Big enough for the picture at full size
+    const size_t LumaSize   = (size_t)Video->Width * Video->Height;
+    const size_t ChromaSize = (size_t)Video->ChromaWidth * Video->ChromaHeight;
+    CreateUploadRing(&Video->UploadRing, LumaSize + 2 * ChromaSize);
+    SetVideoOutputSize(Video, Video->Width, Video->Height);
+
+    CreatePlaneTextures(Video);
+}
+
+// Sizes the picture in the planes to that of the frames arriving.
+void SetVideoOutputSize(video* Video, int Width, int Height) {
+    const AVPixFmtDescriptor* PlanarDesc = av_pix_fmt_desc_get(Video->PlanarFormat);
+    int Level = 0;
+    while (Level < MAX_REDUCTION_LEVEL && AV_CEIL_RSHIFT(Video->Width, Level) > Width) {
+        Level++;
+    }
+    Video->ReductionLevel     = Level;
+    Video->OutputWidth        = Width;
+    Video->OutputHeight       = Height;
+    Video->OutputChromaWidth  = AV_CEIL_RSHIFT(Video->OutputWidth,  PlanarDesc->log2_chroma_w);
+    Video->OutputChromaHeight = AV_CEIL_RSHIFT(Video->OutputHeight, PlanarDesc->log2_chroma_h);
+
+    const size_t LumaSize   = (size_t)Video->OutputWidth * Video->OutputHeight;
+    const size_t ChromaSize = (size_t)Video->OutputChromaWidth * Video->OutputChromaHeight;
+    Video->PlaneOffsets[0] = 0;
+    Video->PlaneOffsets[1] = LumaSize;
+    Video->PlaneOffsets[2] = LumaSize + ChromaSize;
+    Video->PlaneStrides[0] = Video->OutputWidth;
+    Video->PlaneStrides[1] = Video->OutputChromaWidth;
+    Video->PlaneStrides[2] = Video->OutputChromaWidth;
+}
+
+// What a frame from the decoder takes, at whatever lowres it was opened with.
+int64_t GetDecodedFrameBytes(AVCodecContext* CodecContext) {
+    int64_t FrameBytes = av_image_get_buffer_size(CodecContext->pix_fmt,
+        CodecContext->width, CodecContext->height, 1);
+    if (FrameBytes <= 0) {
+        // Assume 8-bit 4:2:0 for formats we can't size
+        FrameBytes = (int64_t)CodecContext->width * CodecContext->height * 3 / 2;
+    }
+    return FrameBytes;
+}
+
+// Sizes the video stream's frame queue from its decoded frame size and rate.
+void RegisterVideoFrameBudget(stream* Stream) {
+    int64_t FrameBytes = GetDecodedFrameBytes(Stream->CodecContext);
+
+    AVRational Rate = Stream->Stream->avg_frame_rate;
+    if (!Rate.num || !Rate.den) {
+        Rate = Stream->Stream->r_frame_rate;
+    }
+    double FramesPerSecond = (Rate.num && Rate.den) ? av_q2d(Rate) : 0;
+
+    RegisterFrameBudget(&Stream->FrameBudget, FrameBytes, FramesPerSecond,
+        FRAME_HIGH_WATERMARK);
+}
+
+video* OpenVideo(const char* InputFilename, audio_state* AudioState, bool Muted) {
+    video* Video = calloc(1, sizeof(video));
+
+    Video->AudioState = AudioState;
+
+    int Result;
+
+    Result = avformat_open_input(&Video->FormatContext, InputFilename, NULL, NULL);
+    if (Result < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Can't open file\n");
+        free(Video);
+        return NULL;
+    }
+
+    Result = avformat_find_stream_info(Video->FormatContext, NULL);
+    if (Result < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Can't get stream info\n");
+        free(Video);
+        return NULL;
+    }
+
+    OpenCodec(AVMEDIA_TYPE_AUDIO,
+        Video->FormatContext,
+        &Video->AudioStream,
+        !Muted
+        );
+
+    OpenCodec(AVMEDIA_TYPE_VIDEO,
+        Video->FormatContext,
+        &Video->VideoStream,
+        true
+        );
+
+    if (!Video->VideoStream.Valid && !Video->AudioStream.Valid) {
+        av_log(NULL, AV_LOG_ERROR, "Couldn't find an audio or video stream\n");
+        free(Video);
+        return NULL;
+    }
+
+    if (Video->VideoStream.Valid) {
+        Video->Width  = Video->VideoStream.CodecContext->width;
+        Video->Height = Video->VideoStream.CodecContext->height;
+
+        CreateVideoTextures(Video);
+        RegisterVideoFrameBudget(&Video->VideoStream);
+        StartKeyframeIndex(&Video->KeyframeIndex, InputFilename, Video->VideoStream.Index);
+    }
+
+    CreateRingBuffer(&Video->VideoStream.Buffer, sizeof(AVFrame*), FRAME_BUFFER_SIZE);
+    CreateRingBuffer(&Video->AudioStream.Buffer, sizeof(AVFrame*), FRAME_BUFFER_SIZE);
+    CreateRingBuffer(&Video->VideoStream.Packets, sizeof(AVPacket*), PACKET_QUEUE_SIZE);
+    CreateRingBuffer(&Video->AudioStream.Packets, sizeof(AVPacket*), PACKET_QUEUE_SIZE);
+    CreateFramePool(&Video->VideoStream);
+    CreateFramePool(&Video->AudioStream);
+
+    // printf("Opened %ix%i video with video format %s audio format %s\n",
+    //     Video->Width, Video->Height,
+    //     av_get_pix_fmt_name(Video->VideoStream.CodecContext->pix_fmt),
+    //     av_get_sample_fmt_name(Video->AudioStream.CodecContext->sample_fmt)
+    //     );
+
+    // The demuxer skips the packets of every stream we don't play
+    atomic_init(&Video->AudioMuted, Muted);
+    Video->AudioDiscarded = Muted;
+    for (int StreamIndex = 0; StreamIndex < Video->FormatContext->nb_streams; StreamIndex++) {
+        bool Wanted =
+            (Video->VideoStream.Valid && StreamIndex == Video->VideoStream.Index) ||
+            (Video->AudioStream.Valid && StreamIndex == Video->AudioStream.Index && !Muted);
+        if (!Wanted) {
+            Video->FormatContext->streams[StreamIndex]->discard = AVDISCARD_ALL;
+        }
+    }
+
+    // Without an audio engine the audio is still decoded, just never played.
+    // The resampler is set up from the first decoded frame.
+    if (!Video->AudioStream.Valid) {
+        Video->AudioState = NULL;
+    }
+    Video->AudioChannel = Video->AudioState ? GetNextChannel(Video->AudioState) : -1;
+    if (Video->AudioChannel == -1) {
+        // Out of channels, the video plays silently on the wall clock
+        Video->AudioState = NULL;
+    }
+    if (Video->AudioState && Muted) {
+        // Silent channels never take a voice from audible ones
+        SetAudioChannelGain(Video->AudioState, Video->AudioChannel, 0);
+    }
+    InitMediaClock(&Video->Clock, Video->AudioState, Video->AudioChannel);
+
+    int64_t StartTime = Video->FormatContext->start_time;
+    atomic_init(&Video->LoopStart, StartTime != AV_NOPTS_VALUE ? StartTime / (double)AV_TIME_BASE : 0);
+    atomic_init(&Video->LoopEnd, INFINITY);
+    atomic_init(&Video->LoopLength, 0);
+
+    Video->CacheLayer = -1;
+    atomic_init(&Video->FramesCached, false);
+
+    InitWakeup(&Video->DemuxWakeup);
+    InitWakeup(&Video->VideoStream.DecodeWakeup);
+    InitWakeup(&Video->AudioStream.DecodeWakeup);
+
+    int ResultCode = pthread_create(&Video->DemuxThread, NULL, DemuxThreadMain, Video);
+    assert(!ResultCode);
+
+    if (Video->VideoStream.Valid) {
+        ResultCode = pthread_create(&Video->VideoStream.DecodeThread, NULL, VideoDecodeThreadMain, Video);
+        assert(!ResultCode);
+    }
+
+    if (Video->AudioStream.Valid) {
+        ResultCode = pthread_create(&Video->AudioStream.DecodeThread, NULL, AudioDecodeThreadMain, Video);
+        assert(!ResultCode);
+    }
+
+    return Video;
+}
+
+
+stream* GetPacketStream(video* Video, int StreamIndex) {
+    if (Video->AudioStream.Valid && StreamIndex == Video->AudioStream.Index) {
+        return &Video->AudioStream;
+    }
+    if (Video->VideoStream.Valid && !Video->VideoStream.Retired &&
+        StreamIndex == Video->VideoStream.Index) {
+        return &Video->VideoStream;
+    }
+    return NULL;
+}
+
+bool HasPacketSpace(stream* Stream) {
+    return !Stream->Valid || Stream->Retired ||
+        GetRingBufferWriteAvailable(&Stream->Packets) > 0;
+}
+
+// Wakes the stream's decode thread if it was starved of packets.
+void QueuePacket(stream* Stream, AVPacket* Packet) {
+    if (!Stream->Valid || Stream->Retired) return;
+    bool WasEmpty = GetRingBufferReadAvailable(&Stream->Packets) == 0;
+    WriteRingBuffer(&Stream->Packets, &Packet, 1);
+    if (WasEmpty || Packet == &FlushPacket || Packet == &LoopPacket) {
+        SignalWakeup(&Stream->DecodeWakeup);
+    }
+}
+
+// Advances a ring's read index, and wakes the thread that writes
+// to it once the ring has drained past LowWatermark.
+void AdvanceQueue(
+    ringbuffer*        RingBuffer,
+    ring_buffer_size_t Count,
+    ring_buffer_size_t LowWatermark,
+    wakeup*            Writer)
+{
+    ring_buffer_size_t CountBefore = GetRingBufferReadAvailable(RingBuffer);
+    AdvanceRingBufferReadIndex(RingBuffer, Count);
+    ring_buffer_size_t CountAfter = GetRingBufferReadAvailable(RingBuffer);
+    if (CountBefore > LowWatermark && CountAfter <= LowWatermark) {
+        SignalWakeup(Writer);
+    }
+}
+
+void ConsumePackets(video* Video, stream* Stream, ring_buffer_size_t Count) {
+    AdvanceQueue(&Stream->Packets, Count, PACKET_LOW_WATERMARK, &Video->DemuxWakeup);
+}
+
+int GetFrameHighWatermark(stream* Stream) {
+    if (Stream->FrameBudget.Registered) {
+        return GetFrameBudgetDepth(&Stream->FrameBudget);
+    }
+    return FRAME_HIGH_WATERMARK;
+}
+
+int GetFrameLowWatermark(stream* Stream) {
+    return GetFrameHighWatermark(Stream) / 2;
+}
+
+void ConsumeFrames(stream* Stream, ring_buffer_size_t Count) {
+    AdvanceQueue(&Stream->Buffer, Count, GetFrameLowWatermark(Stream), &Stream->DecodeWakeup);
+}
+
+void FreeQueuedPacket(AVPacket* Packet) {
+    if (Packet != NULL && Packet != &FlushPacket && Packet != &LoopPacket) {
+        av_packet_free(&Packet);
+    }
+}
+
+void FreeQueuedFrame(AVFrame* Frame) {
+    if (Frame != NULL && Frame != &FlushFrame) {
+        av_frame_free(&Frame);
+    }
+}
+
+void CreateFramePool(stream* Stream) {
+    CreateRingBuffer(&Stream->FreeFrames, sizeof(AVFrame*), 2 * FRAME_POOL_SIZE);
+    CreateRingBuffer(&Stream->FreePackets, sizeof(AVPacket*), 2 * PACKET_POOL_SIZE);
+    if (!Stream->Valid) return;
+
+    for (int I = 0; I < FRAME_POOL_SIZE; I++) {
+        AVFrame* Frame = av_frame_alloc();
+        WriteRingBuffer(&Stream->FreeFrames, &Frame, 1);
+    }
+    for (int I = 0; I < PACKET_POOL_SIZE; I++) {
+        AVPacket* Packet = av_packet_alloc();
+        WriteRingBuffer(&Stream->FreePackets, &Packet, 1);
+    }
+}
+
+// Should only be called once the stream's threads have stopped.
+void FreeFramePool(stream* Stream) {
+    AVFrame* Frame = NULL;
+    while (ReadRingBuffer(&Stream->FreeFrames, &Frame, 1)) {
+        av_frame_free(&Frame);
+    }
+    av_frame_free(&Stream->SpareFrame);
+
+    AVPacket* Packet = NULL;
+    while (ReadRingBuffer(&Stream->FreePackets, &Packet, 1)) {
+        av_packet_free(&Packet);
+    }
+
+    FreeRingBuffer(&Stream->FreeFrames);
+    FreeRingBuffer(&Stream->FreePackets);
+}
+
+// Should only be called from the stream's decode thread.
+AVFrame* TakeFrame(stream* Stream) {
+    AVFrame* Frame = NULL;
+    if (Stream->SpareFrame) {
+        Frame = Stream->SpareFrame;
+        Stream->SpareFrame = NULL;
+        return Frame;
+    }
+    if (ReadRingBuffer(&Stream->FreeFrames, &Frame, 1)) {
+        return Frame;
+    }
+    Stream->Stats.FrameAllocations++;
+    return av_frame_alloc();
+}
+
+// Hands a presented or dropped frame back to the stream's decode thread.
+// Should only be called from the thread that consumes the stream's frames.
+void RecycleFrame(stream* Stream, AVFrame* Frame) {
+    if (Frame == NULL || Frame == &FlushFrame) return;
+
+    av_frame_unref(Frame);
+    if (GetRingBufferWriteAvailable(&Stream->FreeFrames) > 0) {
+        WriteRingBuffer(&Stream->FreeFrames, &Frame, 1);
+    } else {
+        av_frame_free(&Frame);
+    }
+}
+
+// Should only be called from the demux thread.
+AVPacket* TakePacket(video* Video) {
+    AVPacket* Packet = NULL;
+    if (Video->SparePacket) {
+        Packet = Video->SparePacket;
+        Video->SparePacket = NULL;
+        return Packet;
+    }
+    if (ReadRingBuffer(&Video->VideoStream.FreePackets, &Packet, 1) ||
+        ReadRingBuffer(&Video->AudioStream.FreePackets, &Packet, 1)) {
+        return Packet;
+    }
+    Video->PacketAllocations++;
+    return av_packet_alloc();
+}
+
+// Hands a packet the demux thread took back to it,
+// for a packet that was never queued.
+void KeepSparePacket(video* Video, AVPacket* Packet) {
+    av_packet_unref(Packet);
+    Video->SparePacket = Packet;
+}
+
+// Hands a sent or discarded packet back to the demux thread.
+// Should only be called from the stream's decode thread.
+void RecyclePacket(stream* Stream, AVPacket* Packet) {
+    if (Packet == NULL || Packet == &FlushPacket || Packet == &LoopPacket) return;
+
+    av_packet_unref(Packet);
+    if (GetRingBufferWriteAvailable(&Stream->FreePackets) > 0) {
+        WriteRingBuffer(&Stream->FreePackets, &Packet, 1);
+    } else {
+        av_packet_free(&Packet);
+    }
+}
+
+// For packets and frames that don't say how long they last.
+// 0 if the stream doesn't have a frame rate either.
+double GetNominalFrameDuration(stream* Stream) {
+    AVRational Rate = Stream->Stream->avg_frame_rate;
+    if (Rate.num <= 0 || Rate.den <= 0) {
+        Rate = Stream->Stream->r_frame_rate;
+    }
+    return Rate.num > 0 && Rate.den > 0 ? av_q2d(av_inv_q(Rate)) : 0;
+}
+
+// The picture, or the sound if there's no picture still being read.
+stream* GetLeadStream(video* Video) {
+    if (Video->VideoStream.Valid && !Video->VideoStream.Retired) {
+        return &Video->VideoStream;
+    }
+    return &Video->AudioStream;
+}
+
+// Seeks once, on the picture if there is one, so both streams
+// start reading from the same place. Each decode thread then
+// skips ahead to Timestamp from the marker after this.
+int SeekFile(video* Video, double Timestamp) {
+    stream* Lead = GetLeadStream(Video);
+    int64_t Target = Timestamp / Lead->Timebase;
+
+    int64_t Keyframe;
+    if (Lead == &Video->VideoStream &&
+        FindKeyframe(&Video->KeyframeIndex, Target, &Keyframe))
+    {
+        Target = Keyframe;
+        Video->IndexedSeeks++;
+    }
+    return av_seek_frame(Video->FormatContext, Lead->Index, Target, AVSEEK_FLAG_BACKWARD);
+}
+
+void ResetLoopOffsets(video* Video, double LoopOffset) {
+    stream* Streams[2] = { &Video->AudioStream, &Video->VideoStream };
+    Video->LoopOffset = LoopOffset;
+    for (int Index = 0; Index < ARRAY_LEN(Streams); Index++) {
+        stream* Stream = Streams[Index];
+        if (!Stream->Valid) continue;
+        Stream->LoopOffset = llrint(LoopOffset / Stream->Timebase);
+        Stream->PassedLoopEnd = false;
+    }
+}
+
+// A seek lands on file time, undoing any loops so far.
+void SeekStreams(video* Video, double Timestamp) {
+    SeekFile(Video, Timestamp);
+    ResetLoopOffsets(Video, 0);
+
+    atomic_store(&Video->VideoStream.SeekTarget, Timestamp);
+    atomic_store(&Video->AudioStream.SeekTarget, Timestamp);
+}
+
+// Goes back to the start of the loop from End. Returns false if
+// the file can't be looped, in which case it's left where it is.
+bool LoopFile(video* Video, double End) {
+    double Length = End - atomic_load(&Video->LoopStart);
+    if (Length <= 0 || SeekFile(Video, atomic_load(&Video->LoopStart)) < 0) {
+        return false;
+    }
+    atomic_store(&Video->LoopLength, Length);
+    ResetLoopOffsets(Video, Video->LoopOffset + Length);
+    Video->Loops++;
+
+    QueuePacket(&Video->AudioStream, &LoopPacket);
+    QueuePacket(&Video->VideoStream, &LoopPacket);
+    return true;
+}
+
+// True once every stream being read has got past the loop's end.
+bool ReachedLoopEnd(video* Video) {
+    if (isinf(atomic_load(&Video->LoopEnd))) {
+        return false;
+    }
+    if (Video->VideoStream.Valid && !Video->VideoStream.Retired &&
+        !Video->VideoStream.PassedLoopEnd) {
+        return false;
+    }
+    if (Video->AudioStream.Valid && !Video->AudioDiscarded &&
+        !Video->AudioStream.PassedLoopEnd) {
+        return false;
+    }
+    return true;
+}
+
+// Marks packets outside the loop to be decoded without giving any frames
+// (they may still be needed as references), then moves the packet to
+// where it falls after the loops so far.
+void PlacePacket(video* Video, stream* Stream, AVPacket* Packet) {
+    int64_t Timestamp = Packet->pts != AV_NOPTS_VALUE ? Packet->pts : Packet->dts;
+    if (Timestamp != AV_NOPTS_VALUE) {
+        const double Time = Timestamp * Stream->Timebase;
+        const double LoopEnd = atomic_load(&Video->LoopEnd);
+        if (Time < atomic_load(&Video->LoopStart) || Time >= LoopEnd) {
+            Packet->flags |= AV_PKT_FLAG_DISCARD;
+        }
+        // Nothing shown before the loop's end decodes after a packet
+        // past it, so once the decode order gets there the loop's done
+        if (Packet->dts != AV_NOPTS_VALUE && Packet->dts * Stream->Timebase >= LoopEnd) {
+            Stream->PassedLoopEnd = true;
+        }
+        const double Duration = Packet->duration > 0 ?
+            Packet->duration * Stream->Timebase : GetNominalFrameDuration(Stream);
+        Stream->LastPacketEnd = MAX(Stream->LastPacketEnd, Time + Duration);
+    }
+
+    if (Packet->pts != AV_NOPTS_VALUE) Packet->pts += Stream->LoopOffset;
+    if (Packet->dts != AV_NOPTS_VALUE) Packet->dts += Stream->LoopOffset;
+}
+
+// Reads the next packet from the file and hands it
+// to the decode thread of the stream it belongs to.
+// Returns false if there was nothing to do.
+// Should only be called from the demux thread.
+bool DemuxNextPacket(video* Video) {
+    stream* Streams[2] = { &Video->AudioStream, &Video->VideoStream };
+
+    // Stop or start reading audio once the video is muted or unmuted
+    bool Muted = atomic_load(&Video->AudioMuted);
+    if (Video->AudioStream.Valid && Muted != Video->AudioDiscarded) {
+        Video->AudioStream.Stream->discard = Muted ? AVDISCARD_ALL : AVDISCARD_DEFAULT;
+        Video->AudioDiscarded = Muted;
+    }
+
+    // A clip playing from its frame cache never needs its picture again
+    if (Video->VideoStream.Valid && !Video->VideoStream.Retired &&
+        atomic_load(&Video->FramesCached)) {
+        Video->VideoStream.Stream->discard = AVDISCARD_ALL;
+        Video->VideoStream.Retired = true;
+    }
+
+    // Coalesce any seeks requested since we last looked into a single seek,
+    // but owe each stream one flush marker per request.
+    int SeekRequests = atomic_exchange(&Video->SeekRequests, 0);
+    if (SeekRequests > 0) {
+        SeekStreams(Video, atomic_load(&Video->SeekTarget));
+        for (int Index = 0; Index < ARRAY_LEN(Streams); Index++) {
+            stream* Stream = Streams[Index];
+            if (!Stream->Valid) continue;
+            atomic_fetch_add(&Stream->PendingPacketFlushes, SeekRequests);
+            Stream->FlushMarkersOwed += SeekRequests;
+            // Let the decode thread start discarding stale packets
+            SignalWakeup(&Stream->DecodeWakeup);
+        }
+        Video->EndOfStream = false;
+    }
+
+    bool DidWork = SeekRequests > 0;
+    for (int Index = 0; Index < ARRAY_LEN(Streams); Index++) {
+        stream* Stream = Streams[Index];
+        while (Stream->FlushMarkersOwed > 0 && HasPacketSpace(Stream)) {
+            QueuePacket(Stream, &FlushPacket);
+            Stream->FlushMarkersOwed--;
+            DidWork = true;
+        }
+    }
+
+    if (Video->EndOfStream) {
+        return DidWork;
+    }
+
+    // Only read a packet once we know we can queue it,
+    // whichever stream it turns out to belong to.
+    // The same goes for a loop's markers.
+    for (int Index = 0; Index < ARRAY_LEN(Streams); Index++) {
+        if (!HasPacketSpace(Streams[Index]) || Streams[Index]->FlushMarkersOwed > 0) {
+            return DidWork;
+        }
+    }
+
+    // Nothing worth reading until the audio's unmuted
+    bool Reading = (Video->VideoStream.Valid && !Video->VideoStream.Retired) ||
+                   (Video->AudioStream.Valid && !Video->AudioDiscarded);
+    if (!Reading) {
+        return DidWork;
+    }
+
+    if (ReachedLoopEnd(Video) && LoopFile(Video, atomic_load(&Video->LoopEnd))) {
+        return true;
+    }
+
+    AVPacket* Packet = TakePacket(Video);
+
+    int Result = av_read_frame(Video->FormatContext, Packet);
+    if (Result < 0) {
+        KeepSparePacket(Video, Packet);
+
+        // Loop from the end of the picture (or sound, if there's none)
+        stream* Lead = GetLeadStream(Video);
+        double End = MIN(atomic_load(&Video->LoopEnd), Lead->LastPacketEnd);
+        if (LoopFile(Video, End)) {
+            return true;
+        }
+        Video->EndOfStream = true;
+
+        // A NULL packet tells the decode threads to begin flush mode
+        QueuePacket(&Video->AudioStream, NULL);
+        QueuePacket(&Video->VideoStream, NULL);
+        return true;
+    }
+
+    // Not every demuxer honours discard, and audio read
+    // just before a mute is dropped by the audio thread
+    stream* Stream = GetPacketStream(Video, Packet->stream_index);
+    if (Stream == NULL) {
+        KeepSparePacket(Video, Packet);
+        return true;
+    }
+
+    PlacePacket(Video, Stream, Packet);
+    QueuePacket(Stream, Packet);
+    return true;
+}
+
+// Where a frame stops being shown, for skipping up to a seek target.
+double GetFrameEndTime(AVFrame* Frame, stream* Stream) {
+    if (Frame->pkt_duration > 0) {
+        return GetFramePTS(Frame, Stream) + Frame->pkt_duration * Stream->Timebase;
+    }
+    if (Frame->sample_rate > 0) {
+        return GetFramePTS(Frame, Stream) + (double)Frame->nb_samples / Frame->sample_rate;
+    }
+    return GetFramePTS(Frame, Stream) + GetNominalFrameDuration(Stream);
+}
+
+// Returns true if the frame ends before the seek target and shouldn't be kept.
+bool SkipFrameBeforeSeekTarget(stream* Stream, AVFrame* Frame) {
+    if (!Stream->Skipping) {
+        return false;
+    }
+    if (Frame->pts != AV_NOPTS_VALUE &&
+        GetFrameEndTime(Frame, Stream) <= Stream->SkipUntil)
+    {
+        Stream->Stats.SeekSkippedFrames++;
+        return true;
+    }
+    // Reached the target, decode everything again
+    Stream->Skipping = false;
+    Stream->CodecContext->skip_frame = AVDISCARD_DEFAULT;
+    return false;
+}
+
+// Brings a decoded video frame to the size the consumer wants, in a
+// format quad.frag reads, so the render thread only ever copies planes.
+// Decoders that could decode at that size with lowres leave nothing to do.
+void ReduceVideoFrame(stream* Stream, AVFrame* Frame) {
+    AVCodecParameters* Params = Stream->Stream->codecpar;
+    const int Level  = atomic_load(&Stream->WantedReduction);
+    const int Width  = AV_CEIL_RSHIFT(Params->width,  Level);
+    const int Height = AV_CEIL_RSHIFT(Params->height, Level);
+    const enum AVPixelFormat Format = GetPlanarFormat(Frame->format);
+
+    // Queued frames are the wanted size from here on
+    if (Level != Stream->QueuedReduction) {
+        SetFrameBudgetFrameBytes(&Stream->FrameBudget,
+            av_image_get_buffer_size(Format, Width, Height, 1));
+        Stream->QueuedReduction = Level;
+    }
+
+    if (Frame->width == Width && Frame->height == Height && Frame->format == Format) {
+        return;
+    }
+
+    // Reduced frames are recycled through a pool, like the decoder's own
+    const int Size = av_image_get_buffer_size(Format, Width, Height, 1);
+    if (Size != Stream->ScaledBufferSize) {
+        av_buffer_pool_uninit(&Stream->ScaledBuffers);
+        Stream->ScaledBuffers    = av_buffer_pool_init(Size, NULL);
+        Stream->ScaledBufferSize = Size;
+    }
+
+    AVFrame* Reduced = TakeFrame(Stream);
+    Reduced->buf[0] = av_buffer_pool_get(Stream->ScaledBuffers);
+    if (!Reduced->buf[0]) {
+        // Out of memory: pass the frame on as it is
+        Stream->SpareFrame = Reduced;
+        return;
+    }
+    av_image_fill_arrays(Reduced->data, Reduced->linesize, Reduced->buf[0]->data,
+        Format, Width, Height, 1);
+    Reduced->width  = Width;
+    Reduced->height = Height;
+    Reduced->format = Format;
+    av_frame_copy_props(Reduced, Frame);
+
+    // Use https://www.ffmpeg.org/ffmpeg-scaler.html
+    Stream->Scaler = sws_getCachedContext(Stream->Scaler,
+        Frame->width, Frame->height, Frame->format,
+        Width, Height, Format,
+        SWS_BILINEAR, NULL, NULL, NULL);
+    sws_scale(Stream->Scaler,
+        (const uint8_t *const *)Frame->data,
+        Frame->linesize,
+        0,             // Begin slice
+        Frame->height, // Num slices
+        Reduced->data,
+        Reduced->linesize);
+
+    if (Format != Frame->format) {
+        // What swscale produces by default
+        Reduced->colorspace  = AVCOL_SPC_SMPTE170M;
+        Reduced->color_range = AVCOL_RANGE_MPEG;
+    }
+
+    av_frame_unref(Frame);
+    av_frame_move_ref(Frame, Reduced);
+    Stream->SpareFrame = Reduced;
+}
+
+// Moves every frame the decoder has ready into the stream's frame ring,
+// stopping early if the ring fills up.
+// Returns the last avcodec_receive_frame result: AVERROR(EAGAIN) when
+// the decoder wants more input, AVERROR_EOF once it is fully drained,
+// or 0 if the ring filled up first.
+int ReceiveFrames(stream* Stream, int* NumFrames) {
+    *NumFrames = 0;
+
+    // Always leave a slot free for the end-of-stream frame
+    while (GetRingBufferWriteAvailable(&Stream->Buffer) > 1) {
+        AVFrame* Frame = TakeFrame(Stream);
+        int Result = avcodec_receive_frame(Stream->CodecContext, Frame);
+        if (Result != 0) {
+            // Nothing was written into the frame, keep it for next time
+            Stream->SpareFrame = Frame;
+            if (Result != AVERROR_EOF && Result != AVERROR(EAGAIN)) {
+                av_log(NULL, AV_LOG_ERROR, "Error receiving frame\n");
+                // Skip the broken frame and keep feeding the decoder
+                Result = AVERROR(EAGAIN);
+            }
+            return Result;
+        }
+        ResolveLateSkippedPacket(Stream, Frame);
+        if (SkipFrameBeforeSeekTarget(Stream, Frame)) {
+            av_frame_unref(Frame);
+            Stream->SpareFrame = Frame;
+            continue;
+        }
+        if (Stream->CodecContext->codec_type == AVMEDIA_TYPE_VIDEO) {
+            ReduceVideoFrame(Stream, Frame);
+        }
+        WriteRingBuffer(&Stream->Buffer, &Frame, 1);
+        (*NumFrames)++;
+    }
+    return 0;
+}
+
+void RecordFramesPerPacket(stream* Stream, int NumFrames) {
+    decode_stats* Stats = &Stream->Stats;
+    Stats->FramesReceived += NumFrames;
+    Stats->MaxFramesPerPacket = MAX(Stats->MaxFramesPerPacket, NumFrames);
+    if (NumFrames == 0) {
+        Stats->PacketsWithoutFrames++;
+    }
+    Stats->PacketsInFlight = MAX(0, Stats->PacketsInFlight - NumFrames);
+}
 
-    AVCodecParameters* CodecParams = Stream->Stream->codecpar;
-    Stream->Codec = avcodec_find_decoder(CodecParams->codec_id);
-    if (Stream->Codec == NULL) {
-        av_log(NULL, AV_LOG_ERROR, "Can't find decoder\n");
+// Called once the decoder has given up its last frame.
+void FinishStream(video* Video, stream* Stream) {
+    // Pop the NULL or loop packet that started the drain
+    AVPacket* Packet = NULL;
+    PeekRingBuffer(&Stream->Packets, &Packet, 1);
+    ConsumePackets(Video, Stream, 1);
+    Stream->Draining = false;
+    SettleLateSkippedPackets(Stream, true);
+
+    if (Packet == &LoopPacket) {
+        // The demuxer has already gone back round, carry on from there
+        avcodec_flush_buffers(Stream->CodecContext);
         return;
     }
+    Stream->Drained = true;
 
-    Stream->CodecContext = avcodec_alloc_context3(Stream->Codec);
-    if (Stream->CodecContext == NULL) {
-        av_log(NULL, AV_LOG_ERROR, "Can't allocate decoder context\n");
-        // AVERROR(ENOMEM);
-        return;
+    // Write a null frame to indicate that the stream is over
+    AVFrame* Frame = NULL;
+    WriteRingBuffer(&Stream->Buffer, &Frame, 1);
+}
+
+// Picks what the video decoder skips from how late the packet about to
+// be sent is. Late frames would only be dropped once decoded, so the
+// decoder skips what it can until its output is back ahead of the clock.
+void UpdateLateSkipping(video* Video, stream* Stream, AVPacket* Packet) {
+    AVCodecContext* CodecContext = Stream->CodecContext;
+    if (Packet->pts == AV_NOPTS_VALUE) return;
+
+    // Nothing is late while the clock waits for a seek
+    double Lateness = 0;
+    if (!IsMediaClockHeld(&Video->Clock)) {
+        Lateness = GetVideoTime(Video) - Packet->pts * Stream->Timebase;
     }
 
-    Result = avcodec_parameters_to_context(Stream->CodecContext, CodecParams);
-    if (Result) {
-        av_log(NULL, AV_LOG_ERROR, "Can't copy decoder context\n");
-        return;
+    enum AVDiscard Discard = CodecContext->skip_frame;
+    if (Lateness > LATE_SKIP_NONKEY_SECONDS) {
+        Discard = AVDISCARD_NONKEY;
+    } else if (Lateness > LATE_SKIP_NONREF_SECONDS) {
+        Discard = AVDISCARD_NONREF;
+    } else if (Lateness <= 0) {
+        Discard = AVDISCARD_DEFAULT;
     }
 
-    Result = avcodec_open2(Stream->CodecContext, Stream->Codec, NULL);
-    if (Result < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Can't open decoder\n");
-        return;
+    // Frames after a skipped reference frame would decode against
+    // what's missing, so only decode them again from a keyframe
+    if (CodecContext->skip_frame == AVDISCARD_NONKEY && Discard < AVDISCARD_NONKEY &&
+        !(Packet->flags & AV_PKT_FLAG_KEY)) {
+        Discard = AVDISCARD_NONKEY;
     }
 
-    Stream->Timebase = av_q2d(Stream->Stream->time_base);
+    if (Discard != CodecContext->skip_frame) {
+        if (Discard > CodecContext->skip_frame) {
+            Stream->Stats.LateSkipSwitches++;
+        }
+        CodecContext->skip_frame = Discard;
+    }
+}
 
-    Stream->Valid = true;
+// Called once a packet is in the decoder, which was tagged with its
+// place in the send order. The decoder hands the tag back on the frame
+// the packet decodes to, so a packet sent while skipping late frames
+// counts as skipped if it never gives one.
+void TrackLateSkippedPacket(stream* Stream) {
+    bool* Pending = &Stream->LateSkipPending[Stream->Stats.PacketsSent % LATE_SKIP_WINDOW];
+    if (*Pending) {
+        // Sent a window ago, and nothing ever came of it
+        Stream->Stats.LateSkippedFrames++;
+    }
+    *Pending = !Stream->Skipping &&
+        Stream->CodecContext->skip_frame >= AVDISCARD_NONREF;
 }
 
-void* DecodeThreadMain(void* Arg) {
-    video* Video = Arg;
+void ResolveLateSkippedPacket(stream* Stream, AVFrame* Frame) {
+    const uint64_t Sequence = Frame->reordered_opaque;
+    if (Sequence < Stream->Stats.PacketsSent &&
+        Stream->Stats.PacketsSent - Sequence <= LATE_SKIP_WINDOW)
+    {
+        Stream->LateSkipPending[Sequence % LATE_SKIP_WINDOW] = false;
+    }
+}
 
-    while (!Video->StopDecodeThread) {
-        DecodeVideo(Video);
+// Once the decoder is drained, packets still waiting on a frame were
+// skipped. A flush throws them away undecided, so they aren't counted.
+void SettleLateSkippedPackets(stream* Stream, bool Skipped) {
+    for (int Index = 0; Index < LATE_SKIP_WINDOW; Index++) {
+        if (Stream->LateSkipPending[Index] && Skipped) {
+            Stream->Stats.LateSkippedFrames++;
+        }
+        Stream->LateSkipPending[Index] = false;
     }
-    return NULL;
 }
 
-video* OpenVideo(const char* InputFilename, NVGcontext* NVG, audio_state* AudioState) {
-    video* Video = calloc(1, sizeof(video));
+// Sends the next queued packet to the stream's decoder and moves every
+// frame it produces into the stream's frame ring.
+// Returns false if there was nothing to do.
+// Should only be called from the stream's decode thread.
+bool DecodeNextPacket(video* Video, stream* Stream) {
+    int Result;
+    int NumFrames;
 
-    Video->AudioState = AudioState;
-    Video->NVG = NVG;
+    bool HavePacket = GetRingBufferReadAvailable(&Stream->Packets) > 0;
 
-    int Result;
+    AVPacket* Packet = NULL;
+    if (HavePacket) {
+        PeekRingBuffer(&Stream->Packets, &Packet, 1);
+    }
 
-    Result = avformat_open_input(&Video->FormatContext, InputFilename, NULL, NULL);
-    if (Result < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Can't open file\n");
-        free(Video);
-        return NULL;
+    if (HavePacket && Packet == &FlushPacket) {
+        // Need room to pass the marker on to the consumer
+        if (GetRingBufferWriteAvailable(&Stream->Buffer) == 0) {
+            return false;
+        }
+        ConsumePackets(Video, Stream, 1);
+        atomic_fetch_sub(&Stream->PendingPacketFlushes, 1);
+
+        if (Stream->CodecContext) {
+            avcodec_flush_buffers(Stream->CodecContext);
+        }
+        SettleLateSkippedPackets(Stream, false);
+        Stream->Draining = false;
+        Stream->Drained  = false;
+        Stream->Filling  = true;
+        Stream->Stats.PacketsInFlight = 0;
+        Stream->Skipping  = true;
+        Stream->SkipUntil = atomic_load(&Stream->SeekTarget);
+        ApplyDecodeBudget(Stream);
+
+        AVFrame* Marker = &FlushFrame;
+        WriteRingBuffer(&Stream->Buffer, &Marker, 1);
+        return true;
     }
 
-    Result = avformat_find_stream_info(Video->FormatContext, NULL);
-    if (Result < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Can't get stream info\n");
-        free(Video);
-        return NULL;
+    // Packets read before a seek are no longer wanted
+    if (HavePacket && atomic_load(&Stream->PendingPacketFlushes) > 0) {
+        ConsumePackets(Video, Stream, 1);
+        RecyclePacket(Stream, Packet);
+        return true;
     }
 
-    OpenCodec(AVMEDIA_TYPE_AUDIO,
-        Video->FormatContext,
-        &Video->AudioStream
-        );
+    // Nothing more until the next seek
+    if (Stream->Drained) {
+        return false;
+    }
 
-    OpenCodec(AVMEDIA_TYPE_VIDEO,
-        Video->FormatContext,
-        &Video->VideoStream
-        );
+    ring_buffer_size_t NumBufferedFrames = GetRingBufferReadAvailable(&Stream->Buffer);
+    SetFrameBudgetBuffered(&Stream->FrameBudget, NumBufferedFrames);
+    if (NumBufferedFrames >= GetFrameHighWatermark(Stream)) {
+        Stream->Filling = false;
+    } else if (NumBufferedFrames <= GetFrameLowWatermark(Stream)) {
+        Stream->Filling = true;
+    }
+    if (!Stream->Filling) {
+        return false;
+    }
 
-    if (!Video->VideoStream.Valid && !Video->AudioStream.Valid) {
-        av_log(NULL, AV_LOG_ERROR, "Couldn't find an audio or video stream\n");
-        free(Video);
-        return NULL;
+    // Collect anything the decoder is still holding before giving it more
+    // input (e.g. frames left over from when the ring last filled up).
+    Result = ReceiveFrames(Stream, &NumFrames);
+    Stream->Stats.FramesReceived += NumFrames;
+    Stream->Stats.PacketsInFlight = MAX(0, Stream->Stats.PacketsInFlight - NumFrames);
+    if (Result == AVERROR_EOF) {
+        FinishStream(Video, Stream);
+        return true;
+    }
+    if (Result != AVERROR(EAGAIN) || !HavePacket) {
+        return NumFrames > 0;
     }
 
-    if (Video->VideoStream.Valid) {
-        Video->Width  = Video->VideoStream.CodecContext->width;
-        Video->Height = Video->VideoStream.CodecContext->height;
+    AVCodecContext* CodecContext = Stream->CodecContext;
+
+    if (Packet == NULL || Packet == &LoopPacket) {
+        // End of stream or loop: the packet stays queued
+        // until the decoder has given up all its frames.
+        if (!Stream->Draining) {
+            avcodec_send_packet(CodecContext, NULL);
+            Stream->Draining = true;
+        }
+    } else {
+        if (Packet->flags & AV_PKT_FLAG_KEY) {
+            ApplyDecodeBudget(Stream);
+        }
+
+        // On the way to a seek target, only decode what later frames
+        // reference. Packet timestamps are presentation times, so this
+        // only ever drops frames that would have been skipped anyway.
+        if (Stream->Skipping && CodecContext->codec_type == AVMEDIA_TYPE_VIDEO) {
+            bool BeforeTarget = Packet->pts != AV_NOPTS_VALUE &&
+                (Packet->pts + Packet->duration) * Stream->Timebase <= Stream->SkipUntil;
+            CodecContext->skip_frame = BeforeTarget ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+        } else if (Stream == &Video->VideoStream) {
+            UpdateLateSkipping(Video, Stream, Packet);
+        }
 
-        Video->ColorConvertContext = sws_getContext(
-                Video->Width, Video->Height, Video->VideoStream.CodecContext->pix_fmt,
-                Video->Width, Video->Height, AV_PIX_FMT_RGB24,
-                0, NULL, NULL, NULL);
-        Video->ColorConvertBufferSize = 3*Video->Width*Video->Height;
-        Video->ColorConvertBuffer = malloc(Video->ColorConvertBufferSize);
+        CodecContext->reordered_opaque = Stream->Stats.PacketsSent;
+        Result = avcodec_send_packet(CodecContext, Packet);
+        if (Result == AVERROR(EAGAIN)) {
+            // Decoder is still full; keep the packet for next time
+            return NumFrames > 0;
+        }
 
-        Video->Texture = CreateTexture(Video->Width, Video->Height, 3);
-        Video->NVGImage = nvglCreateImageFromHandleGL3(
-                    NVG,
-                    Video->Texture,
-                    Video->Width,
-                    Video->Height,
-                    NVG_IMAGE_NODELETE // This texture ID isn't owned by NVG,
-                                       // don't delete it when deleting the NVG Image!
-                );
+        ConsumePackets(Video, Stream, 1);
+        RecyclePacket(Stream, Packet);
+        if (Result != 0) {
+            av_log(NULL, AV_LOG_ERROR, "Error sending packet\n");
+            return true;
+        }
+        TrackLateSkippedPacket(Stream);
+        Stream->Stats.PacketsSent++;
+        Stream->Stats.PacketsInFlight++;
+        Stream->Stats.MaxPacketsInFlight = MAX(Stream->Stats.MaxPacketsInFlight,
+                                               Stream->Stats.PacketsInFlight);
     }
 
-    CreateRingBuffer(&Video->VideoStream.Buffer, sizeof(AVFrame*), FRAME_BUFFER_SIZE);
-    CreateRingBuffer(&Video->AudioStream.Buffer, sizeof(AVFrame*), FRAME_BUFFER_SIZE);
+    // Take every frame this packet produced
+    Result = ReceiveFrames(Stream, &NumFrames);
+    if (Packet != NULL && Packet != &LoopPacket) {
+        RecordFramesPerPacket(Stream, NumFrames);
+    } else {
+        Stream->Stats.FramesReceived += NumFrames;
+    }
+    if (Result == AVERROR_EOF) {
+        FinishStream(Video, Stream);
+    }
 
-    Video->StartTime = GetTimeInSeconds();
+    return true;
+}
 
-    // printf("Opened %ix%i video with video format %s audio format %s\n",
-    //     Video->Width, Video->Height,
-    //     av_get_pix_fmt_name(Video->VideoStream.CodecContext->pix_fmt),
-    //     av_get_sample_fmt_name(Video->AudioStream.CodecContext->sample_fmt)
-    //     );
 
-    Video->AudioChannel = GetNextChannel(AudioState);
+color_matrix GetColorMatrix(AVFrame* Frame, int Height) {
+    switch (Frame->colorspace) {
+        case AVCOL_SPC_BT709:
+            return COLOR_MATRIX_BT709;
+        case AVCOL_SPC_BT470BG:
+        case AVCOL_SPC_SMPTE170M:
+            return COLOR_MATRIX_BT601;
+        default:
+            // Untagged HD video is almost always BT.709
+            return Height >= 720 ? COLOR_MATRIX_BT709 : COLOR_MATRIX_BT601;
+    }
+}
 
-    int ResultCode = pthread_create(&Video->DecodeThread, NULL, DecodeThreadMain, Video);
-    assert(!ResultCode);
+bool IsFullRange(AVFrame* Frame) {
+    switch (Frame->format) {
+        case AV_PIX_FMT_YUVJ420P:
+        case AV_PIX_FMT_YUVJ422P:
+        case AV_PIX_FMT_YUVJ444P:
+            return true;
+        default:
+            return Frame->color_range == AVCOL_RANGE_JPEG;
+    }
+}
 
-    return Video;
+bool ShouldUseMipmaps(video* Video) {
+    if (Video->Filter != VIDEO_FILTER_MIPMAP_WHEN_MINIFIED ||
+        Video->DisplayWidth <= 0 || Video->DisplayHeight <= 0)
+    {
+        return false;
+    }
+    double Minification = MAX((double)Video->OutputWidth  / Video->DisplayWidth,
+                              (double)Video->OutputHeight / Video->DisplayHeight);
+    return Minification > MIPMAP_MINIFICATION_THRESHOLD;
 }
 
+// Rebuilds mips after an upload if the video is minified enough to need them.
+// quad.frag samples only level 0 of videos that aren't UsingMipmaps.
+void UpdateVideoMipmaps(video* Video) {
+    Video->UsingMipmaps = Video->PlaneLevels > 1 && ShouldUseMipmaps(Video);
+
+    // Cached frames are never uploaded again, so each cache layer
+    // gets its mips now, once, in case the video is drawn smaller later
+    const bool FillingCache = Video->CacheLayer >= 0 && Video->PlaneLevels > 1;
+    if (!Video->UsingMipmaps && !FillingCache) return;
+
+    // Only the layer just uploaded, even when the textures are shared,
+    // and only the part of it the picture fills. A video's own chroma
+    // textures are smaller than its luma, so have fewer levels.
+    const int ChromaLevels = MIN(Video->PlaneLevels,
+        GetMipLevelCount(Video->ChromaLayerWidth, Video->ChromaLayerHeight));
+    GenerateTextureLayerMipmaps(Video->PlaneTextures[0], Video->PlaneLayer,
+        Video->PlaneLevels, Video->OutputWidth, Video->OutputHeight);
+    for (int Plane = 1; Plane < 3; Plane++) {
+        GenerateTextureLayerMipmaps(Video->PlaneTextures[Plane], Video->PlaneLayer,
+            ChromaLevels, Video->OutputChromaWidth, Video->OutputChromaHeight);
+    }
+    Video->MipmapBuilds++;
+}
 
-void DecodeNextFrame(video* Video) {
+void SetVideoFilter(video* Video, video_filter Filter) {
+    if (!Video || !Video->VideoStream.Valid || Video->Filter == Filter) return;
 
-    int Result;
+    Video->Filter = Filter;
+    if (Video->SharesPlaneTextures) {
+        // Levels belong to the shared textures
+        return;
+    }
+    glDeleteTextures(3, Video->PlaneTextures);
+    CreatePlaneTextures(Video);
+}
 
-    av_init_packet(&Video->Packet);
+void SetVideoDisplaySize(video* Video, int Width, int Height) {
+    if (!Video) return;
 
-    if (!Video->EndOfStream) {
-        Result = av_read_frame(Video->FormatContext, &Video->Packet);
-        if (Result < 0) {
-            Video->EndOfStream = 1;
+    Video->DisplayWidth  = Width;
+    Video->DisplayHeight = Height;
+
+    // Halve the picture for as long as it would still cover the display.
+    // The decode thread shrinks its next frame to suit, and decoders
+    // that can decode smaller themselves reopen at their next keyframe.
+    int Level = 0;
+    if (Width > 0 && Height > 0) {
+        while (Level < MAX_REDUCTION_LEVEL &&
+               AV_CEIL_RSHIFT(Video->Width,  Level + 1) >= Width &&
+               AV_CEIL_RSHIFT(Video->Height, Level + 1) >= Height) {
+            Level++;
         }
     }
+    atomic_store(&Video->VideoStream.WantedReduction, Level);
+}
 
-    // If at end of stream, begin flush mode by sending a NULL packet
-    if (Video->EndOfStream) {
-        Video->Packet.data = NULL;
-        Video->Packet.size = 0;
+void SetVideoMuted(video* Video, bool Muted) {
+    if (!Video || !Video->AudioStream.Valid ||
+        atomic_load(&Video->AudioMuted) == Muted) return;
+
+    atomic_store(&Video->AudioMuted, Muted);
+    if (Video->AudioState) {
+        SetAudioChannelGain(Video->AudioState, Video->AudioChannel, Muted ? 0 : 1);
     }
 
-    int StreamIndex = Video->Packet.stream_index;
-    stream* Stream = NULL;
-    if (StreamIndex == Video->AudioStream.Index) {
-        Stream = &Video->AudioStream;
-    } else if (StreamIndex == Video->VideoStream.Index) {
-        Stream = &Video->VideoStream;
+    if (Muted) {
+        // Stop what's queued now, and keep time on the wall clock
+        if (Video->AudioState) {
+            FlushAudioChannel(Video->AudioState, Video->AudioChannel);
+        }
+        SignalWakeup(&Video->AudioStream.DecodeWakeup);
+        SignalWakeup(&Video->DemuxWakeup);
     } else {
-        printf("Unknown stream index %i\n", StreamIndex);
-        av_packet_unref(&Video->Packet);
-        av_init_packet(&Video->Packet);
-        return;
+        // The demuxer is ahead of what's showing by however much video
+        // is queued, so start the audio from where the picture is
+        SeekVideo(Video, GetVideoFileTime(Video));
     }
+}
 
-    AVCodecContext* CodecContext = Stream->CodecContext;
+void SetVideoAudioPriority(video* Video, int Priority) {
+    if (!Video || !Video->AudioState) return;
 
-    Result = avcodec_send_packet(CodecContext, &Video->Packet);
-    if (Result != 0) {
-        av_log(NULL, AV_LOG_ERROR, "Error sending packet\n");
-        return;
+    SetAudioChannelPriority(Video->AudioState, Video->AudioChannel, Priority);
+}
+
+int GetVideoCacheFrames(video* Video) {
+    if (!Video || !Video->VideoStream.Valid || !isinf(atomic_load(&Video->LoopEnd))) {
+        return 0;
+    }
+
+    stream* Stream = &Video->VideoStream;
+    int64_t Frames = Stream->Stream->nb_frames;
+    if (Frames <= 0) {
+        double Duration = 0;
+        if (Stream->Stream->duration != AV_NOPTS_VALUE) {
+            Duration = Stream->Stream->duration * Stream->Timebase;
+        } else if (Video->FormatContext->duration != AV_NOPTS_VALUE) {
+            Duration = Video->FormatContext->duration / (double)AV_TIME_BASE;
+        }
+        double FrameDuration = GetNominalFrameDuration(Stream);
+        if (Duration <= 0 || FrameDuration <= 0) {
+            return 0;
+        }
+        Frames = ceil(Duration / FrameDuration);
     }
+    // Container frame counts and durations can come up a little short
+    Frames += Frames / 16 + 2;
+    return Frames < INT_MAX ? (int)Frames : 0;
+}
 
-    AVFrame* Frame = av_frame_alloc();
+void GetVideoCacheFrameSize(video* Video, int* Width, int* Height) {
+    *Width  = 0;
+    *Height = 0;
+    if (!Video || !Video->VideoStream.Valid) return;
 
-    Result = avcodec_receive_frame(CodecContext, Frame);
-    if (Result != 0 && Result != AVERROR_EOF && Result != AVERROR(EAGAIN)) {
-        av_log(NULL, AV_LOG_ERROR, "Error receiving frame\n");
-        return;
+    // As ReduceVideoFrame sizes them
+    const int Level = atomic_load(&Video->VideoStream.WantedReduction);
+    *Width  = AV_CEIL_RSHIFT(Video->Width,  Level);
+    *Height = AV_CEIL_RSHIFT(Video->Height, Level);
+}
+
+// Points the planes at a layer of shared texture arrays,
+// whose chroma layers are as big as their luma ones.
+void SetSharedPlaneTextures(video* Video, const GLuint Textures[3], int Layer,
+    int LayerWidth, int LayerHeight, int Levels)
+{
+    for (int Plane = 0; Plane < 3; Plane++) {
+        Video->PlaneTextures[Plane] = Textures[Plane];
     }
-    // printf("PACKET RECEIVED: %i\n", Result);
+    Video->PlaneLayer        = Layer;
+    Video->PlaneLevels       = Levels;
+    Video->LumaLayerWidth    = LayerWidth;
+    Video->LumaLayerHeight   = LayerHeight;
+    Video->ChromaLayerWidth  = LayerWidth;
+    Video->ChromaLayerHeight = LayerHeight;
+}
 
-    if (Result == 0) {
-        if (GetRingBufferWriteAvailable(&Stream->Buffer) > 0) {
-            WriteRingBuffer(&Stream->Buffer, &Frame, 1);
-        } else {
-            // Otherwise, we just drop the frame
-            av_frame_free(&Frame);
+void CacheVideoFrames(video* Video, const GLuint Textures[3], int FirstLayer, int Layers,
+    int LayerWidth, int LayerHeight, int Levels)
+{
+    if (!Video || !Video->SharesPlaneTextures || Layers <= 0) return;
+
+    Video->CacheFrames      = calloc(Layers, sizeof(cached_frame));
+    Video->CacheLayerWidth  = LayerWidth;
+    Video->CacheLayerHeight = LayerHeight;
+    Video->CacheLevels      = Levels;
+    Video->CacheLayer       = FirstLayer;
+    Video->CacheCapacity    = Layers;
+    Video->CachedFrames     = 0;
+    for (int Plane = 0; Plane < 3; Plane++) {
+        Video->CacheTextures[Plane]    = Textures[Plane];
+        Video->UncachedTextures[Plane] = Video->PlaneTextures[Plane];
+    }
+    Video->UncachedLayer       = Video->PlaneLayer;
+    Video->UncachedLayerWidth  = Video->LumaLayerWidth;
+    Video->UncachedLayerHeight = Video->LumaLayerHeight;
+    Video->UncachedLevels      = Video->PlaneLevels;
+}
+
+// Goes back to uploading every frame into the video's own layer.
+void AbandonFrameCache(video* Video) {
+    if (Video->CacheLayer < 0) return;
+
+    Video->CacheLayer   = -1;
+    Video->CachedFrames = 0;
+    SetSharedPlaneTextures(Video, Video->UncachedTextures, Video->UncachedLayer,
+        Video->UncachedLayerWidth, Video->UncachedLayerHeight, Video->UncachedLevels);
+}
+
+int CompareCachedFrames(const void* A, const void* B) {
+    const double TimeA = ((const cached_frame*)A)->Time;
+    const double TimeB = ((const cached_frame*)B)->Time;
+    return (TimeA > TimeB) - (TimeA < TimeB);
+}
+
+// Called with the first frame of the clip's second time round.
+void FinishFrameCache(video* Video) {
+    const double Start  = atomic_load(&Video->LoopStart);
+    const double Length = atomic_load(&Video->LoopLength);
+
+    // Playing back looks frames up by where they are in the file,
+    // which after a seek may not be the order they were cached in
+    for (int Index = 0; Index < Video->CachedFrames; Index++) {
+        double Offset = fmod(Video->CacheFrames[Index].Time - Start, Length);
+        Video->CacheFrames[Index].Time = Start + (Offset < 0 ? Offset + Length : Offset);
+    }
+    qsort(Video->CacheFrames, Video->CachedFrames, sizeof(cached_frame), CompareCachedFrames);
+    Video->CacheEnd = Start + Length;
+
+    atomic_store(&Video->FramesCached, true);
+    SignalWakeup(&Video->VideoStream.DecodeWakeup);
+    SignalWakeup(&Video->DemuxWakeup);
+}
+
+// Points the frame's upload at the next cache layer.
+// Returns true instead if the frame completed the cache.
+bool CacheVideoFrame(video* Video, AVFrame* Frame) {
+    const double PTS = GetFramePTS(Frame, &Video->VideoStream);
+    const double Length = atomic_load(&Video->LoopLength);
+
+    // Back round to the first frame cached, give or take half a frame
+    if (Video->CachedFrames > 0 && Length > 0) {
+        const double Slack = MAX(GetNominalFrameDuration(&Video->VideoStream) / 2, 0.001);
+        if (PTS >= Video->CacheFrames[0].Time + Length - Slack) {
+            FinishFrameCache(Video);
+            return true;
         }
-    } else {
-        av_frame_free(&Frame);
     }
 
-    av_packet_unref(&Video->Packet);
-    av_init_packet(&Video->Packet);
+    // Out of layers, or drawn bigger since the cache was sized
+    if (Video->CachedFrames == Video->CacheCapacity ||
+        Frame->width  > Video->CacheLayerWidth ||
+        Frame->height > Video->CacheLayerHeight) {
+        AbandonFrameCache(Video);
+        return false;
+    }
 
-    if (Video->EndOfStream) {
-        // Write a null frame to indicate that the stream is over
-        Frame = NULL;
-        if (GetRingBufferWriteAvailable(&Stream->Buffer) > 0) {
-            WriteRingBuffer(&Stream->Buffer, &Frame, 1);
+    cached_frame* Cached = &Video->CacheFrames[Video->CachedFrames];
+    Cached->Time  = PTS;
+    Cached->Layer = Video->CacheLayer + Video->CachedFrames;
+    Video->CachedFrames++;
+    SetSharedPlaneTextures(Video, Video->CacheTextures, Cached->Layer,
+        Video->CacheLayerWidth, Video->CacheLayerHeight, Video->CacheLevels);
+    return false;
+}
+
+// Finds the cached frame showing at Time into the file.
+int FindCachedFrame(video* Video, double Time) {
+    int Low  = 0;
+    int High = Video->CachedFrames - 1;
+    if (Time < Video->CacheFrames[0].Time) {
+        return High; // Still the last frame of the time round before
+    }
+    while (Low < High) {
+        int Mid = (Low + High + 1) / 2;
+        if (Video->CacheFrames[Mid].Time <= Time) {
+            Low = Mid;
+        } else {
+            High = Mid - 1;
         }
     }
+    return Low;
+}
+
+// Shows the cached frame for the clock by pointing the video at its layer.
+// Returns true if that's a different frame.
+bool TickCachedVideo(video* Video, double DisplayLead) {
+    // Every frame is already there, so a seek has nothing to wait for
+    if (IsMediaClockHeld(&Video->Clock)) {
+        ReleaseMediaClock(&Video->Clock);
+    }
+
+    Video->UsingMipmaps = Video->PlaneLevels > 1 && ShouldUseMipmaps(Video);
+
+    const double Time = GetFileTime(Video, GetVideoTime(Video) + DisplayLead);
+    const int Layer = Video->CacheFrames[FindCachedFrame(Video, Time)].Layer;
+    if (Layer == Video->PlaneLayer) {
+        return false;
+    }
+    Video->PlaneLayer = Layer;
+    return true;
+}
 
-    if (Result == AVERROR(EAGAIN)) {
-        DecodeNextFrame(Video);
+double GetTimeUntilNextCachedFrame(video* Video, double DisplayLead) {
+    const double Time   = GetFileTime(Video, GetVideoTime(Video) + DisplayLead);
+    const double Start  = atomic_load(&Video->LoopStart);
+    const double Length = atomic_load(&Video->LoopLength);
+    const cached_frame* Frames = Video->CacheFrames;
+
+    int Index = FindCachedFrame(Video, Time);
+    double Next;
+    if (Time < Frames[0].Time) {
+        Next = Frames[0].Time;
+    } else if (Index + 1 < Video->CachedFrames) {
+        Next = Frames[Index + 1].Time;
+    } else {
+        Next = Frames[0].Time + Length;
     }
+    // The loop may wrap before the next frame comes round
+    if (Length > 0) {
+        Next = MIN(Next, Start + Length);
+    }
+    return MAX(0, Next - Time);
 }
 
+bool ShareVideoPlaneTextures(video* Video, const GLuint Textures[3], int Layer,
+    int LayerWidth, int LayerHeight, int Levels)
+{
+    if (!Video || !Video->VideoStream.Valid) return false;
+    if (Video->Width > LayerWidth || Video->Height > LayerHeight) return false;
+
+    if (!Video->SharesPlaneTextures) {
+        glDeleteTextures(3, Video->PlaneTextures);
+    }
+
+    SetSharedPlaneTextures(Video, Textures, Layer, LayerWidth, LayerHeight, Levels);
+    Video->SharesPlaneTextures = true;
+    Video->UsingMipmaps        = false;
+    return true;
+}
 
+// Copies the frame's Y, U and V planes into the video's upload ring
+// and uploads them from there; quad.frag does the conversion to RGB.
 void UploadVideoFrame(video* Video, AVFrame* Frame) {
-    // Use https://www.ffmpeg.org/ffmpeg-scaler.html
-    // to convert from YUV420P to packed RGB24
-    uint8_t* OutputData[1] = { Video->ColorConvertBuffer }; // RGB24 have one plane
-    int OutputLineSize[1] = { 3 * Video->Width }; // RGB stride
+    // The decode thread changes the size between frames
+    if (Frame->width != Video->OutputWidth || Frame->height != Video->OutputHeight) {
+        SetVideoOutputSize(Video, Frame->width, Frame->height);
+    }
 
-    int Result = sws_scale(Video->ColorConvertContext,
-        (const uint8_t *const *)Frame->data,
-        Frame->linesize,
-        0,             // Begin slice
-        Video->Height, // Num slices
-        OutputData,
-        OutputLineSize);
-    (void)Result;
+    size_t RegionOffset;
+    uint8_t* Region = BeginUpload(&Video->UploadRing, &RegionOffset);
+
+    uint8_t* Planes[4] = {
+        Region + Video->PlaneOffsets[0],
+        Region + Video->PlaneOffsets[1],
+        Region + Video->PlaneOffsets[2],
+        NULL
+    };
+    int Linesizes[4] = {
+        Video->PlaneStrides[0],
+        Video->PlaneStrides[1],
+        Video->PlaneStrides[2],
+        0
+    };
 
-    UpdateTexture(Video->Texture, Video->Width, Video->Height, GL_RGB, Video->ColorConvertBuffer);
+    av_image_copy_plane(Planes[0], Linesizes[0], Frame->data[0], Frame->linesize[0],
+        Video->OutputWidth, Video->OutputHeight);
+    av_image_copy_plane(Planes[1], Linesizes[1], Frame->data[1], Frame->linesize[1],
+        Video->OutputChromaWidth, Video->OutputChromaHeight);
+    av_image_copy_plane(Planes[2], Linesizes[2], Frame->data[2], Frame->linesize[2],
+        Video->OutputChromaWidth, Video->OutputChromaHeight);
+
+    Video->ColorMatrix = GetColorMatrix(Frame, Video->Height);
+    Video->FullRange = IsFullRange(Frame);
+
+    EndUploadWrites(&Video->UploadRing);
+
+    // With the upload ring bound, data pointers are offsets into it
+    for (int Plane = 0; Plane < 3; Plane++) {
+        const bool IsChroma = Plane > 0;
+        UpdateTextureLayer(Video->PlaneTextures[Plane], Video->PlaneLayer,
+            IsChroma ? Video->OutputChromaWidth  : Video->OutputWidth,
+            IsChroma ? Video->OutputChromaHeight : Video->OutputHeight,
+            Linesizes[Plane],
+            GL_RED,
+            (const void*)(RegionOffset + Video->PlaneOffsets[Plane]));
+    }
+
+    FinishUpload(&Video->UploadRing);
+
+    UpdateVideoMipmaps(Video);
+}
+
+
+// After a seek, throws away everything up to the decoder's flush marker.
+// Returns false if the marker hasn't come through yet.
+bool DiscardFlushedFrames(stream* Stream) {
+    while (atomic_load(&Stream->PendingFrameFlushes) > 0 &&
+           GetRingBufferReadAvailable(&Stream->Buffer) > 0)
+    {
+        AVFrame* StaleFrame = NULL;
+        PeekRingBuffer(&Stream->Buffer, &StaleFrame, 1);
+        ConsumeFrames(Stream, 1);
+        if (StaleFrame == &FlushFrame) {
+            atomic_fetch_sub(&Stream->PendingFrameFlushes, 1);
+        } else {
+            RecycleFrame(Stream, StaleFrame);
+        }
+    }
+    return atomic_load(&Stream->PendingFrameFlushes) == 0;
 }
 
+// Takes the frame that should be showing DisplayLead seconds from now,
+// dropping any that would never be seen.
+void GetCurrentFrame(video* Video, stream* Stream, double DisplayLead, AVFrame** Frame) {
+    if (!DiscardFlushedFrames(Stream)) {
+        return;
+    }
+    FinishSeek(Video, Stream);
 
-void GetCurrentFrame(video* Video, stream* Stream, AVFrame** Frame) {
-    const double Now = GetVideoTime(Video);
+    const double Now = GetVideoTime(Video) + DisplayLead;
 
     // Handle the case where we only have 1 frame left
     if (GetRingBufferReadAvailable(&Stream->Buffer) == 1) {
         AVFrame* CurrFrame = NULL;
         PeekRingBuffer(&Stream->Buffer, &CurrFrame, 1);
         if (CurrFrame == NULL) {
-            SeekVideo(Video, 0);
-            return;
+            return; // A file that couldn't loop has ended
         }
 
         const double CurrPTS = GetFramePTS(CurrFrame, Stream);
         if (CurrPTS <= Now) {
             *Frame = CurrFrame;
-            AdvanceRingBufferReadIndex(&Stream->Buffer, 1);
+            ConsumeFrames(Stream, 1);
             return;
         }
     }
@@ -287,12 +1829,11 @@ void GetCurrentFrame(video* Video, stream* Stream, AVFrame** Frame) {
         AVFrame* NextFrame = Frames[1];
         if (CurrFrame != NULL && NextFrame == NULL) {
             *Frame = CurrFrame;
-            AdvanceRingBufferReadIndex(&Stream->Buffer, 1);
+            ConsumeFrames(Stream, 1);
             return;
         }
 
         if (CurrFrame == NULL) {
-            SeekVideo(Video, 0);
             return;
         }
 
@@ -303,13 +1844,13 @@ void GetCurrentFrame(video* Video, stream* Stream, AVFrame** Frame) {
             NextPTS >  Now) {
             // It's time, present it!
             *Frame = CurrFrame;
-            AdvanceRingBufferReadIndex(&Stream->Buffer, 1);
+            ConsumeFrames(Stream, 1);
             CaughtUp = true;
         } else if (CurrPTS < Now && NextPTS < Now) {
             // We're behind, drop the frame
-            AdvanceRingBufferReadIndex(&Stream->Buffer, 1);
-            printf("DROPPING A FRAME\n");
-            av_frame_free(&CurrFrame);
+            ConsumeFrames(Stream, 1);
+            Stream->FramesDropped++;
+            RecycleFrame(Stream, CurrFrame);
         } else if (CurrPTS > Now && NextPTS > Now) {
             // Not time for this frame yet, wait.
             CaughtUp = true;
@@ -318,85 +1859,207 @@ void GetCurrentFrame(video* Video, stream* Stream, AVFrame** Frame) {
 }
 
 
-void TickVideo(video* Video) {
+// Returns how long until the stream's next frame should be taken
+// for display DisplayLead seconds later, 0 if there's a frame
+// to handle right away, or -1 if nothing is buffered (or the stream's ended).
+double GetTimeUntilNextFrame(video* Video, stream* Stream, double DisplayLead) {
+    if (GetRingBufferReadAvailable(&Stream->Buffer) == 0) {
+        return -1;
+    }
+    AVFrame* NextFrame = NULL;
+    PeekRingBuffer(&Stream->Buffer, &NextFrame, 1);
+    if (NextFrame == NULL && atomic_load(&Stream->PendingFrameFlushes) == 0) {
+        return -1;
+    }
+    if (NextFrame == NULL || NextFrame == &FlushFrame ||
+        atomic_load(&Stream->PendingFrameFlushes) > 0)
+    {
+        return 0;
+    }
+    return MAX(0, GetFramePTS(NextFrame, Stream) - (GetVideoTime(Video) + DisplayLead));
+}
+
+double GetVideoTimeUntilNextFrame(video* Video, double DisplayLead) {
+    stream* Stream = &Video->VideoStream;
+    if (!Stream->Valid) {
+        return INFINITY;
+    }
+    if (atomic_load(&Video->FramesCached)) {
+        return GetTimeUntilNextCachedFrame(Video, DisplayLead);
+    }
+    // Nothing worth waking for until a seek's frames arrive
+    if (atomic_load(&Stream->PendingFrameFlushes) > 0) {
+        return -1;
+    }
+    return GetTimeUntilNextFrame(Video, Stream, DisplayLead);
+}
+
+bool TickVideo(video* Video, double DisplayLead) {
+    if (!Video) return false;
+
+    if (atomic_load(&Video->FramesCached)) {
+        return TickCachedVideo(Video, DisplayLead);
+    }
+
+    // A seek starts the cache over from wherever it lands
+    if (Video->CacheLayer >= 0 &&
+        atomic_load(&Video->VideoStream.PendingFrameFlushes) > 0) {
+        Video->CachedFrames = 0;
+    }
 
     AVFrame* VideoFrame = NULL;
-    GetCurrentFrame(Video, &Video->VideoStream, &VideoFrame);
+    GetCurrentFrame(Video, &Video->VideoStream, DisplayLead, &VideoFrame);
     if (VideoFrame) {
+        // So does a change of size, since cached frames all share one
+        if (Video->CacheLayer >= 0 && Video->CachedFrames > 0 &&
+            (VideoFrame->width  != Video->OutputWidth ||
+             VideoFrame->height != Video->OutputHeight)) {
+            Video->CachedFrames = 0;
+        }
+        bool Finished = Video->CacheLayer >= 0 && CacheVideoFrame(Video, VideoFrame);
+        if (Finished) {
+            RecycleFrame(&Video->VideoStream, VideoFrame);
+            return TickCachedVideo(Video, DisplayLead);
+        }
         UploadVideoFrame(Video, VideoFrame);
-        av_frame_free(&VideoFrame);
+        RecycleFrame(&Video->VideoStream, VideoFrame);
+        return true;
     }
+    return false;
 }
 
-ring_buffer_size_t GetAudioChannelCapacity(video* Video) {
-    audio_state* AudioState = Video->AudioState;
-    return GetRingBufferWriteAvailable(&AudioState->Channels[Video->AudioChannel].BlocksIn);
+uint64_t GetChannelLayout(uint64_t Layout, int Channels) {
+    return Layout ? Layout : (uint64_t)av_get_default_channel_layout(Channels);
+}
+
+// (Re)creates the stream's resampler to convert the given input
+// to interleaved stereo float at the audio engine's rate.
+bool ConfigureResampler(stream* Stream, audio_state* AudioState,
+    uint64_t Layout, int Format, int Rate) {
+
+    swr_free(&Stream->Resampler);
+    Stream->Resampler = swr_alloc_set_opts(NULL,
+        AV_CH_LAYOUT_STEREO, AV_SAMPLE_FMT_FLT, AudioState->SampleRate,
+        Layout, Format, Rate,
+        0, NULL);
+    if (!Stream->Resampler || swr_init(Stream->Resampler) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Can't convert %s audio at %iHz\n",
+            av_get_sample_fmt_name(Format), Rate);
+        swr_free(&Stream->Resampler);
+        return false;
+    }
+
+    Stream->ResamplerLayout = Layout;
+    Stream->ResamplerFormat = Format;
+    Stream->ResamplerRate   = Rate;
+    return true;
 }
 
-void QueueAudioFrame(AVFrame* Frame, video* Video) {
+// Converts the frame into the video's audio channel.
+// Returns false if the channel doesn't have room for it yet.
+bool QueueAudioFrame(AVFrame* Frame, video* Video, int Epoch) {
     audio_state* AudioState = Video->AudioState;
-    AVCodecContext* CodecContext = Video->AudioStream.CodecContext;
-    int Length = av_samples_get_buffer_size(NULL,
-        CodecContext->channels, Frame->nb_samples, CodecContext->sample_fmt, 0);
+    stream* Stream = &Video->AudioStream;
+    if (!AudioState) return true;
+
+    // Decoders can change format midstream
+    uint64_t Layout = GetChannelLayout(Frame->channel_layout, Frame->channels);
+    if (Layout             != Stream->ResamplerLayout ||
+        Frame->format      != Stream->ResamplerFormat ||
+        Frame->sample_rate != Stream->ResamplerRate) {
+        ConfigureResampler(Stream, AudioState, Layout, Frame->format, Frame->sample_rate);
+    }
+    if (!Stream->Resampler) {
+        return true; // Can't play it, drop it
+    }
 
-    float* Samples = malloc(Length);
-    memcpy(Samples, Frame->data[0], Length);
+    // Input buffered from before a seek shouldn't leak into what follows
+    if (Stream->ResamplerEpoch != Epoch) {
+        swr_init(Stream->Resampler);
+        Stream->ResamplerEpoch = Epoch;
+    }
 
-    // FIXME: Use:
-    // https://www.ffmpeg.org/ffmpeg-resampler.html
-    // to convert audio to interleaved stereo
+    float* Region1;
+    float* Region2;
+    int Size1, Size2;
+    int MaxFrames = swr_get_out_samples(Stream->Resampler, Frame->nb_samples);
+    if (!GetAudioChannelWriteRegions(AudioState, Video->AudioChannel, MaxFrames,
+        &Region1, &Size1, &Region2, &Size2)) {
+        return false;
+    }
 
-    audio_block AudioBlock = {
-        .Samples         = Samples,
-        .Length          = Frame->nb_samples,
-        .NextSampleIndex = 0
-    };
+    // The first converted frame is whatever the resampler
+    // was still holding from earlier frames
+    const double PTS = GetFramePTS(Frame, Stream) -
+        (double)swr_get_delay(Stream->Resampler, AudioState->SampleRate) / AudioState->SampleRate;
+
+    int Converted = swr_convert(Stream->Resampler,
+        (uint8_t**)&Region1, Size1,
+        (const uint8_t**)Frame->extended_data, Frame->nb_samples);
+    if (Converted == Size1 && Size2 > 0) {
+        // Drain what didn't fit before the ring wrapped. This passes no
+        // samples rather than NULL input, which would flush the resampler.
+        int More = swr_convert(Stream->Resampler,
+            (uint8_t**)&Region2, Size2,
+            (const uint8_t**)Frame->extended_data, 0);
+        if (More > 0) {
+            Converted += More;
+        }
+    }
+    if (Converted < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Can't convert audio frame\n");
+        return true;
+    }
 
-    WriteRingBuffer(&AudioState->Channels[Video->AudioChannel].BlocksIn, &AudioBlock, 1);
+    CommitAudioChannelWrite(AudioState, Video->AudioChannel, Converted,
+        PTS, 1.0 / AudioState->SampleRate, Epoch);
+    return true;
 }
 
 double GetVideoTime(video* Video) {
-    return GetTimeInSeconds() - Video->StartTime;
+    return GetMediaClockTime(&Video->Clock);
 }
 
+// Where in the file the clock is, taking out the loops so far.
+double GetVideoFileTime(video* Video) {
+    return GetFileTime(Video, GetVideoTime(Video));
+}
 
-
-// Decodes video so long as there is buffer space available.
-void DecodeVideo(video* Video) {
-    if (!Video) {
-        return;
+double GetFileTime(video* Video, double Time) {
+    const double Start  = atomic_load(&Video->LoopStart);
+    const double Length = atomic_load(&Video->LoopLength);
+    if (Length > 0 && Time >= Start + Length) {
+        return Start + fmod(Time - Start, Length);
     }
+    return Time;
+}
 
-    ring_buffer_size_t NumBufferedVideoFrames = GetRingBufferReadAvailable(&Video->VideoStream.Buffer);
-    ring_buffer_size_t NumBufferedAudioFrames = GetRingBufferReadAvailable(&Video->AudioStream.Buffer);
-
-    // printf("Number of buffered audio frames: %i\n", NumBufferedAudioFrames);
-    // printf("Number of buffered video frames: %i\n", NumBufferedVideoFrames);
+void SetVideoLoop(video* Video, double Start, double End) {
+    if (!Video) return;
 
-    // See if we should decode anything based on how much we have buffered
-    if (!Video->EndOfStream) {
-        // If we have an audio stream, use the audio buffer as the criterion.
-        // (otherwise video gets ahead of the audio)
-        // If there's no audio stream, use the video buffer as the criterion.
-        bool NeedAudio = NumBufferedAudioFrames < HALF_FRAME_BUFFER_SIZE;
-        bool NeedVideo = NumBufferedVideoFrames < HALF_FRAME_BUFFER_SIZE;
-        if (   ( Video->AudioStream.Valid && NeedAudio)
-            || (!Video->AudioStream.Valid && NeedVideo)
-            )
-        {
-            DecodeNextFrame(Video);
-        }
+    const double Time = GetVideoFileTime(Video);
+    bool Cached = atomic_load(&Video->FramesCached);
+    if (!Cached) {
+        // The cache only knows how to fill from a whole pass of the file
+        AbandonFrameCache(Video);
     }
 
-    // Enqueue audio
-    AVFrame* AudioFrame = NULL;
-    GetCurrentFrame(Video, &Video->AudioStream, &AudioFrame);
-    if (AudioFrame) {
-        QueueAudioFrame(AudioFrame, Video);
-        av_frame_free(&AudioFrame);
+    // Cached clips already know where the file ends
+    double Length = End - Start;
+    if (isinf(End)) {
+        Length = Cached ? Video->CacheEnd - Start : 0;
     }
+    atomic_store(&Video->LoopStart, Start);
+    atomic_store(&Video->LoopEnd, End);
+    atomic_store(&Video->LoopLength, Length);
+
+    // Packets already read were placed for the old loop, so start
+    // over from the same point, or the loop's start if that's outside it
+    SeekVideo(Video, Time >= Start && Time < End ? Time : Start);
 }
 
+
+
 double GetFramePTS(AVFrame* Frame, stream* Stream) {
     return Frame->pts * Stream->Timebase;
 }
@@ -405,62 +2068,170 @@ double GetVideoFrameDuration(video* Video) {
     return Video->VideoStream.Timebase * 1000;
 }
 
+// Frees everything left in the stream's queues.
+// Should only be called once the stream's threads have stopped.
 void FlushStream(stream* Stream) {
     if (!Stream->Valid) return;
 
-    avcodec_flush_buffers(Stream->CodecContext);
+    if (Stream->CodecContext) {
+        avcodec_flush_buffers(Stream->CodecContext);
+    }
 
-    ring_buffer_size_t FramesCount = GetRingBufferReadAvailable(&Stream->Buffer);
+    ring_buffer_size_t PacketsCount = GetRingBufferReadAvailable(&Stream->Packets);
+    for (int I = 0; I < PacketsCount; I++) {
+        AVPacket* Packet = NULL;
+        ReadRingBuffer(&Stream->Packets, &Packet, 1);
+        FreeQueuedPacket(Packet);
+    }
 
+    ring_buffer_size_t FramesCount = GetRingBufferReadAvailable(&Stream->Buffer);
     for (int I = 0; I < FramesCount; I++) {
         AVFrame* Frame = NULL;
         ReadRingBuffer(&Stream->Buffer, &Frame, 1);
-        if (Frame != NULL) {
-            av_frame_free(&Frame);
-        }
-
+        FreeQueuedFrame(Frame);
     }
 }
 
+// Safe to call from any thread: the seek itself happens
+// on the demux thread, and each consumer discards its stale frames.
 void SeekVideo(video* Video, double Timestamp) {
     if (!Video) return;
 
     if (Video->VideoStream.Valid) {
-        int64_t VideoPTS = Timestamp / Video->VideoStream.Timebase;
-        av_seek_frame(Video->FormatContext, Video->VideoStream.Index,
-            VideoPTS, AVSEEK_FLAG_BACKWARD);
-        FlushStream(&Video->VideoStream);
+        atomic_fetch_add(&Video->VideoStream.PendingFrameFlushes, 1);
     }
 
     if (Video->AudioStream.Valid) {
-        int64_t AudioPTS = Timestamp / Video->AudioStream.Timebase;
-        av_seek_frame(Video->FormatContext, Video->AudioStream.Index,
-            AudioPTS, AVSEEK_FLAG_BACKWARD);
-        FlushStream(&Video->AudioStream);
+        atomic_fetch_add(&Video->AudioStream.PendingFrameFlushes, 1);
+    }
+
+    // Published before the request, so the demux thread never takes a
+    // request without a target at least as new. When seeks race, the
+    // last target written wins.
+    atomic_store(&Video->SeekTarget, Timestamp);
+    atomic_store(&Video->SeekStartTime, GetTimeInSeconds());
+    atomic_fetch_add(&Video->SeekRequests, 1);
+    SignalWakeup(&Video->DemuxWakeup);
+
+    HoldMediaClock(&Video->Clock, Timestamp);
+}
+
+// The clock waits where a seek put it until the stream leading it
+// (the picture, or the sound if there's none) has a frame ready there.
+// Should only be called from that stream's consumer, once it has
+// discarded everything from before the seek.
+void FinishSeek(video* Video, stream* Stream) {
+    stream* Lead = Video->VideoStream.Valid ? &Video->VideoStream : &Video->AudioStream;
+    if (Stream != Lead || !IsMediaClockHeld(&Video->Clock) ||
+        GetRingBufferReadAvailable(&Stream->Buffer) == 0)
+    {
+        return;
     }
+    ReleaseMediaClock(&Video->Clock);
+
+    double Latency = GetTimeInSeconds() - atomic_load(&Video->SeekStartTime);
+    Video->SeeksFinished++;
+    Video->TotalSeekLatency += Latency;
+    Video->MaxSeekLatency = MAX(Video->MaxSeekLatency, Latency);
+}
+
+void PrintStreamStats(const char* Name, stream* Stream) {
+    if (!Stream->Valid) return;
 
-    Video->EndOfStream = false;
-    Video->StartTime = GetTimeInSeconds() - Timestamp;
+    decode_stats* Stats = &Stream->Stats;
+    double FramesPerPacket = Stats->PacketsSent ?
+        (double)Stats->FramesReceived / Stats->PacketsSent : 0;
+    printf("  %s: %llu packets -> %llu frames (%.2f per packet, max %i), "
+        "%llu packets gave no frames, %i packets in decoder (max %i), "
+        "%llu frames skipped seeking, %llu skipped late (%llu times), "
+        "%llu dropped after decoding\n",
+        Name,
+        (unsigned long long)Stats->PacketsSent,
+        (unsigned long long)Stats->FramesReceived,
+        FramesPerPacket,
+        Stats->MaxFramesPerPacket,
+        (unsigned long long)Stats->PacketsWithoutFrames,
+        Stats->PacketsInFlight,
+        Stats->MaxPacketsInFlight,
+        (unsigned long long)Stats->SeekSkippedFrames,
+        (unsigned long long)Stats->LateSkippedFrames,
+        (unsigned long long)Stats->LateSkipSwitches,
+        (unsigned long long)Stream->FramesDropped);
+}
+
+void PrintVideoStats(video* Video) {
+    if (!Video) return;
+
+    printf("%s: %llu packet allocations, %llu frame allocations after startup, "
+        "%llu mipmap builds\n",
+        Video->FormatContext->url,
+        (unsigned long long)Video->PacketAllocations,
+        (unsigned long long)(Video->VideoStream.Stats.FrameAllocations +
+                             Video->AudioStream.Stats.FrameAllocations),
+        (unsigned long long)Video->MipmapBuilds);
+    PrintStreamStats("video", &Video->VideoStream);
+    PrintStreamStats("audio", &Video->AudioStream);
+    if (Video->ReductionLevel > 0) {
+        printf("  showing %ix%i of %ix%i\n",
+            Video->OutputWidth, Video->OutputHeight, Video->Width, Video->Height);
+    }
+    if (atomic_load(&Video->FramesCached)) {
+        printf("  playing from %i cached frames\n", Video->CachedFrames);
+    }
+    if (Video->Loops > 0) {
+        printf("  loops: %llu\n", (unsigned long long)Video->Loops);
+    }
+    if (Video->SeeksFinished > 0) {
+        printf("  seeks: %llu (%llu from the keyframe index), "
+            "%.1fms average to first frame, %.1fms max\n",
+            (unsigned long long)Video->SeeksFinished,
+            (unsigned long long)Video->IndexedSeeks,
+            Video->TotalSeekLatency / Video->SeeksFinished * 1000,
+            Video->MaxSeekLatency * 1000);
+    }
 }
 
 void FreeVideo(video* Video) {
     if (!Video) return;
 
-    Video->StopDecodeThread = true;
-    pthread_join(Video->DecodeThread, NULL);
+    Video->StopDecodeThreads = true;
+    SignalWakeup(&Video->DemuxWakeup);
+    SignalWakeup(&Video->VideoStream.DecodeWakeup);
+    SignalWakeup(&Video->AudioStream.DecodeWakeup);
 
-    av_packet_unref(&Video->Packet);
+    pthread_join(Video->DemuxThread, NULL);
+    if (Video->VideoStream.Valid) {
+        pthread_join(Video->VideoStream.DecodeThread, NULL);
+    }
+    if (Video->AudioStream.Valid) {
+        pthread_join(Video->AudioStream.DecodeThread, NULL);
+    }
+
+    if (Video->AudioState) {
+        ReleaseAudioChannel(Video->AudioState, Video->AudioChannel);
+    }
+    swr_free(&Video->AudioStream.Resampler);
+
+    FreeWakeup(&Video->DemuxWakeup);
+    FreeWakeup(&Video->VideoStream.DecodeWakeup);
+    FreeWakeup(&Video->AudioStream.DecodeWakeup);
 
     if (Video->VideoStream.Valid) {
-        glDeleteTextures(1, &Video->Texture);
-        nvgDeleteImage(Video->NVG, Video->NVGImage);
-        sws_freeContext(Video->ColorConvertContext);
-        free(Video->ColorConvertBuffer);
+        if (!Video->SharesPlaneTextures) {
+            glDeleteTextures(3, Video->PlaneTextures);
+        }
+        FreeUploadRing(&Video->UploadRing);
+        sws_freeContext(Video->VideoStream.Scaler);
+        av_buffer_pool_uninit(&Video->VideoStream.ScaledBuffers);
 
         FlushStream(&Video->VideoStream);
 
         avcodec_close(Video->VideoStream.CodecContext);
         avcodec_free_context(&Video->VideoStream.CodecContext);
+        UnregisterDecodeBudget(&Video->VideoStream.Budget);
+        UnregisterFrameBudget(&Video->VideoStream.FrameBudget);
+        FreeKeyframeIndex(&Video->KeyframeIndex);
+        free(Video->CacheFrames);
     }
 
     if (Video->AudioStream.Valid) {
@@ -474,6 +2245,11 @@ void FreeVideo(video* Video) {
 
     FreeRingBuffer(&Video->VideoStream.Buffer);
     FreeRingBuffer(&Video->AudioStream.Buffer);
+    FreeRingBuffer(&Video->VideoStream.Packets);
+    FreeRingBuffer(&Video->AudioStream.Packets);
+    FreeFramePool(&Video->VideoStream);
+    FreeFramePool(&Video->AudioStream);
+    av_packet_free(&Video->SparePacket);
 
     free(Video);
 }
@@ -5,25 +5,135 @@
 #include <libavformat/avformat.h>
 #include <libavutil/imgutils.h>
 #include <libswscale/swscale.h>
+#include <libswresample/swresample.h>
 #include <GL/glew.h>
-#include "nanovg.h"
 #include "video-audio.h"
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include "mvar.h"
+#include "decode-budget.h"
+#include "frame-budget.h"
+#include "wakeup.h"
+#include "media-clock.h"
+#include "keyframe-index.h"
+#include "upload.h"
+
+// Further back in the send order than any decoder's delay: a packet
+// that hasn't given a frame this many packets later never will.
+#define LATE_SKIP_WINDOW 64
+
+// Written only by the stream's decode thread
+typedef struct {
+    uint64_t PacketsSent;
+    uint64_t FramesReceived;
+    uint64_t PacketsWithoutFrames; // The decoder was still filling its delay
+    int      MaxFramesPerPacket;
+    int      PacketsInFlight;      // Sent but not yet turned into frames
+    int      MaxPacketsInFlight;
+    uint64_t FrameAllocations;     // Frames allocated because the pool ran dry
+    uint64_t SeekSkippedFrames;    // Decoded on the way to a seek target, never shown
+    uint64_t LateSkippedFrames;    // Never decoded, because they were late
+    uint64_t LateSkipSwitches;     // Times the decoder started skipping more
+} decode_stats;
 
 typedef struct {
     bool               Valid;
     int                Index;
-    ringbuffer         Buffer;
+    ringbuffer         Packets; // AVPacket*, written by the demux thread
+    ringbuffer         Buffer;  // AVFrame*, written by the stream's decode thread
+    ringbuffer         FreeFrames;  // AVFrame*, returned by the frame consumer
+    ringbuffer         FreePackets; // AVPacket*, returned to the demux thread
+    AVFrame*           SpareFrame;  // Taken from the pool but not yet filled
     AVCodec*           Codec;
     AVCodecContext*    CodecContext;
     AVStream*          Stream;
     double             Timebase;
+
+    decode_budget_entry Budget;
+    int                ThreadCount; // Threads the current CodecContext was opened with
+    int                Lowres;      // Halvings the current CodecContext decodes with
+    int                ReopenFailures;       // In a row
+    int                KeyframesUntilReopen; // Backoff after a failed reopen
+
+    // Video streams: how many times the consumer halves the picture to
+    // fit it on screen. Decoders that support lowres decode at that size,
+    // the decode thread scales down what the others give it, and shrunk
+    // pictures skip some or all of the loop filter.
+    atomic_int         WantedReduction;
+    frame_budget_entry FrameBudget; // Video streams only
+
+    // Video streams: brings frames the decoder couldn't reduce itself
+    // (or that aren't in a format quad.frag reads) to the wanted size,
+    // on the decode thread. Decode thread only.
+    struct SwsContext* Scaler;
+    AVBufferPool*      ScaledBuffers;
+    int                ScaledBufferSize;
+    int                QueuedReduction; // What the frame budget is sized for
+
+    pthread_t          DecodeThread;
+    wakeup             DecodeWakeup;
+    bool               Draining; // Sent the decoder a NULL packet
+    bool               Drained;  // Decoder returned its last frame
+    decode_stats       Stats;
+    uint64_t           FramesDropped; // Decoded but too late to show, consumer only
+    bool               Filling; // Between the frame ring's low and high watermarks
+
+    // Each seek queues a flush marker packet, which the decode thread
+    // turns into a flush marker frame. Everything ahead of a marker
+    // predates the seek and is discarded.
+    atomic_int         PendingPacketFlushes;
+    atomic_int         PendingFrameFlushes;
+    int                FlushMarkersOwed; // Demux thread only
+
+    // Demux thread only
+    int64_t            LoopOffset;    // Added to packets read since the last loop, in Timebase
+    double             LastPacketEnd; // Furthest into the file the stream's packets have reached
+    bool               PassedLoopEnd;
+    bool               Retired;       // Never read from the file again
+
+    // Frames ending before where the last seek landed are decoded
+    // only as far as later frames need, and never handed on
+    _Atomic double     SeekTarget; // Set by the demux thread before queueing its marker
+    bool               Skipping;   // Decode thread only
+    double             SkipUntil;
+
+    // Which of the last LATE_SKIP_WINDOW packets sent, by place in the
+    // send order, went in while skipping late frames and haven't given
+    // a frame yet. Decode thread only.
+    bool               LateSkipPending[LATE_SKIP_WINDOW];
+
+    // Audio streams: converts decoded frames to the audio engine's
+    // interleaved stereo at its rate, on the audio decode thread
+    SwrContext*        Resampler;
+    uint64_t           ResamplerLayout; // Input the resampler was set up for
+    int                ResamplerFormat;
+    int                ResamplerRate;
+    int                ResamplerEpoch;  // Channel epoch its buffered input is from
 } stream;
 
+// A frame kept in a texture layer by a video's frame cache
+typedef struct {
+    double Time; // Presentation time while filling, then time into the file
+    int    Layer;
+} cached_frame;
+
+// Must match the COLOR_MATRIX constants in quad.frag
+typedef enum {
+    COLOR_MATRIX_BT601 = 0,
+    COLOR_MATRIX_BT709 = 1,
+} color_matrix;
+
+typedef enum {
+    // One mip level, plain linear sampling
+    VIDEO_FILTER_LINEAR,
+    // Allocates a full mip chain, but only rebuilds it (and samples it)
+    // while the video is drawn smaller than MIPMAP_MINIFICATION_THRESHOLD
+    VIDEO_FILTER_MIPMAP_WHEN_MINIFIED,
+} video_filter;
+
 typedef struct {
 
-    AVPacket           Packet;
     AVFormatContext*   FormatContext;
 
     stream AudioStream;
@@ -34,35 +144,170 @@ typedef struct {
 
     bool EndOfStream;
 
-    struct SwsContext* ColorConvertContext;
-    size_t ColorConvertBufferSize;
-    uint8_t* ColorConvertBuffer;
+    // Planes are packed tightly into each upload ring region
+    upload_ring UploadRing;
+    size_t   PlaneOffsets[3];
+    int      PlaneStrides[3];
+
+    // Y, U and V planes, converted to RGB in quad.frag.
+    // Each is one layer of a GL_TEXTURE_2D_ARRAY: either the video's own,
+    // or shared with the rest of a wall. The frame fills the top-left
+    // Width x Height (ChromaWidth x ChromaHeight) of the layer.
+    GLuint   PlaneTextures[3];
+    int      PlaneLayer;
+    int      PlaneLevels;
+    int      LumaLayerWidth;
+    int      LumaLayerHeight;
+    int      ChromaLayerWidth;
+    int      ChromaLayerHeight;
+    bool     SharesPlaneTextures;
+    int      ChromaWidth;
+    int      ChromaHeight;
+    enum AVPixelFormat PlanarFormat; // What the planes hold
+
+    // The picture in the planes now: Width x Height halved ReductionLevel
+    // times, as far as it can be while still covering the display.
+    // Frames arrive from the decode thread already at this size.
+    int      ReductionLevel;
+    int      OutputWidth;
+    int      OutputHeight;
+    int      OutputChromaWidth;
+    int      OutputChromaHeight;
+    color_matrix ColorMatrix;
+    bool     FullRange;
+
+    video_filter Filter;
+    int      DisplayWidth;  // On-screen size in pixels, 0 if unknown
+    int      DisplayHeight;
+    bool     UsingMipmaps;  // Mips are current for the last uploaded frame
+    uint64_t MipmapBuilds;
 
-    GLuint   Texture;
-    int      NVGImage;
+    // Short clips can be decoded once into a run of shared layers and
+    // played from there by switching layers. The first time through,
+    // each frame is uploaded into the next layer. Once the clip comes
+    // round again the video decode thread exits, and the picture is
+    // never read from the file again.
+    // The cache layers are in texture arrays of their own, only as big
+    // as the reduced picture; the planes point there while it's in use.
+    GLuint   CacheTextures[3];
+    int      CacheLayerWidth;
+    int      CacheLayerHeight;
+    int      CacheLevels;
+    int      CacheLayer;     // First layer, -1 when not caching
+    int      CacheCapacity;
+    int      CachedFrames;
+    // Where frames go if the clip doesn't fit after all
+    GLuint   UncachedTextures[3];
+    int      UncachedLayer;
+    int      UncachedLayerWidth;
+    int      UncachedLayerHeight;
+    int      UncachedLevels;
+    double   CacheEnd;       // End of the cached clip in file time
+    cached_frame* CacheFrames;
+    atomic_bool FramesCached; // Set once the cache is complete
 
-    double StartTime;
+    media_clock Clock;
 
-    NVGcontext* NVG;
     int AudioChannel;
-    audio_state* AudioState;
+    audio_state* AudioState; // NULL to decode audio without playing it
 
-    pthread_t DecodeThread;
-    bool StopDecodeThread;
+    // Muted videos don't read or decode their audio at all
+    atomic_bool AudioMuted;
+    bool AudioDiscarded; // Demux thread only
+
+    AVPacket* SparePacket;        // Demux thread only
+    uint64_t PacketAllocations;   // Packets allocated because the pool ran dry
+
+    atomic_int SeekRequests;
+    _Atomic double SeekTarget; // In file time, seeking undoes any loops
+
+    // The demux thread loops the file itself: at LoopEnd (or the end of
+    // the file) it seeks back to LoopStart and shifts everything it reads
+    // after by the time looped so far, so frame times keep counting up
+    // and the consumers never see the loop.
+    _Atomic double LoopStart;
+    _Atomic double LoopEnd;    // INFINITY for the end of the file
+    _Atomic double LoopLength; // 0 until known
+    double LoopOffset;         // Demux thread only
+    uint64_t Loops;            // Demux thread only
+
+    // Lets seeks land on the keyframe at or before their target in
+    // containers without an index, where the demuxer only guesses
+    keyframe_index KeyframeIndex;
+    uint64_t IndexedSeeks; // Demux thread only
+
+    // From a seek being asked for to its first frame being ready
+    _Atomic double SeekStartTime;
+    uint64_t SeeksFinished;
+    double TotalSeekLatency;
+    double MaxSeekLatency;
+
+    pthread_t DemuxThread;
+    wakeup DemuxWakeup;
+    bool StopDecodeThreads;
 } video;
 
 // These functions should only be called
 // from a single thread which has an OpenGL
 // context.
 
-video* OpenVideo(const char* InputFilename, NVGcontext* NVG, audio_state* AudioState);
+// Muted videos don't open their audio decoder until they're unmuted.
+video* OpenVideo(const char* InputFilename, audio_state* AudioState, bool Muted);
 
 void FreeVideo(video* Video);
 
-// Uploads a frame to the graphics
-// card when that frame's presentation
-// time arrives.
-// Should be called as fast as possible.
-void TickVideo(video* Video);
+// Uploads the frame that should be on screen
+// DisplayLead seconds from now, if it isn't already.
+// Returns true if a new frame was uploaded.
+bool TickVideo(video* Video, double DisplayLead);
+
+// Returns how long until TickVideo would have a new frame,
+// -1 if there's none buffered to wait for yet,
+// or INFINITY if the video has no picture.
+double GetVideoTimeUntilNextFrame(video* Video, double DisplayLead);
+
+// Recreates the video's textures with the levels the filter needs.
+void SetVideoFilter(video* Video, video_filter Filter);
+
+// Tells the video how big it is drawn, in pixels.
+// Smaller videos are decoded and uploaded at a smaller size.
+void SetVideoDisplaySize(video* Video, int Width, int Height);
+
+// Loops the video between Start and End seconds into the file,
+// End being INFINITY for the whole rest of it.
+void SetVideoLoop(video* Video, double Start, double End);
+
+// Seeks to Timestamp seconds into the file.
+void SeekVideo(video* Video, double Timestamp);
+
+// Muting stops the audio being read or decoded. Unmuting
+// seeks to the current time to bring the audio back in sync.
+void SetVideoMuted(video* Video, bool Muted);
+
+// Videos with higher priority keep their sound when
+// more are playing than the audio engine has voices for.
+void SetVideoAudioPriority(video* Video, int Priority);
+
+// How many layers the video's frame cache would need,
+// or 0 if it can't be played from one.
+int GetVideoCacheFrames(video* Video);
+
+// How big the video's frames arrive for the display size it was last
+// given, which is the size its frame cache holds them at.
+void GetVideoCacheFrameSize(video* Video, int* Width, int* Height);
+
+// Decodes the video once into Layers layers from FirstLayer of the
+// given texture arrays, then plays it from them. Call after sharing
+// its plane textures. Frames bigger than a layer end the caching.
+void CacheVideoFrames(video* Video, const GLuint Textures[3], int FirstLayer, int Layers,
+    int LayerWidth, int LayerHeight, int Levels);
+
+// Moves the video's planes into a layer of shared texture arrays
+// (e.g. a wall's), freeing its own. Returns false if it doesn't fit.
+bool ShareVideoPlaneTextures(video* Video, const GLuint Textures[3], int Layer,
+    int LayerWidth, int LayerHeight, int Levels);
+
+// Prints decoder statistics for each of the video's streams.
+void PrintVideoStats(video* Video);
 
 #endif // VIDEO_H
@@ -0,0 +1,83 @@
+#include "wakeup.h"
+#include <time.h>
+#include <errno.h>
+
+static double GetMonotonicSeconds() {
+    struct timespec Now;
+    clock_gettime(CLOCK_MONOTONIC, &Now);
+    return Now.tv_sec + Now.tv_nsec / 1000000000.0;
+}
+
+static struct timespec ToTimespec(double Seconds) {
+    return (struct timespec){
+        .tv_sec  = (time_t)Seconds,
+        .tv_nsec = (long)((Seconds - (time_t)Seconds) * 1000000000.0)
+    };
+}
+
+void InitWakeup(wakeup* Wakeup) {
+    pthread_mutex_init(&Wakeup->Mutex, NULL);
+
+    pthread_condattr_t Attributes;
+    pthread_condattr_init(&Attributes);
+#if !defined(__APPLE__)
+    // Time out against the monotonic clock, so setting
+    // the wall clock can't stretch or cut short a wait
+    pthread_condattr_setclock(&Attributes, CLOCK_MONOTONIC);
+#endif
+    pthread_cond_init(&Wakeup->Cond, &Attributes);
+    pthread_condattr_destroy(&Attributes);
+
+    Wakeup->Signaled = false;
+}
+
+void FreeWakeup(wakeup* Wakeup) {
+    pthread_cond_destroy(&Wakeup->Cond);
+    pthread_mutex_destroy(&Wakeup->Mutex);
+}
+
+void SignalWakeup(wakeup* Wakeup) {
+    pthread_mutex_lock(&Wakeup->Mutex);
+    Wakeup->Signaled = true;
+    pthread_cond_signal(&Wakeup->Cond);
+    pthread_mutex_unlock(&Wakeup->Mutex);
+}
+
+void WaitWakeup(wakeup* Wakeup) {
+    pthread_mutex_lock(&Wakeup->Mutex);
+    while (!Wakeup->Signaled) {
+        pthread_cond_wait(&Wakeup->Cond, &Wakeup->Mutex);
+    }
+    Wakeup->Signaled = false;
+    pthread_mutex_unlock(&Wakeup->Mutex);
+}
+
+// Deadline is in GetMonotonicSeconds time.
+// Returns nonzero once the deadline has passed.
+static int WaitUntil(wakeup* Wakeup, double Deadline) {
+#if defined(__APPLE__)
+    // macOS can't pick the condition's clock, but can wait a relative time
+    double Remaining = Deadline - GetMonotonicSeconds();
+    if (Remaining <= 0) {
+        return ETIMEDOUT;
+    }
+    struct timespec Timeout = ToTimespec(Remaining);
+    return pthread_cond_timedwait_relative_np(&Wakeup->Cond, &Wakeup->Mutex, &Timeout);
+#else
+    struct timespec Timeout = ToTimespec(Deadline);
+    return pthread_cond_timedwait(&Wakeup->Cond, &Wakeup->Mutex, &Timeout);
+#endif
+}
+
+void TimedWaitWakeup(wakeup* Wakeup, double TimeoutSeconds) {
+    const double Deadline = GetMonotonicSeconds() + TimeoutSeconds;
+
+    pthread_mutex_lock(&Wakeup->Mutex);
+    while (!Wakeup->Signaled) {
+        if (WaitUntil(Wakeup, Deadline)) {
+            break; // Timed out
+        }
+    }
+    Wakeup->Signaled = false;
+    pthread_mutex_unlock(&Wakeup->Mutex);
+}
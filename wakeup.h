@@ -0,0 +1,28 @@
+#if !defined(WAKEUP_H)
+#define WAKEUP_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+// Lets a thread sleep until another thread has work for it.
+// A signal sent while the thread is still busy is remembered,
+// so the next wait returns immediately and no wakeup is lost.
+
+typedef struct {
+    pthread_mutex_t Mutex;
+    pthread_cond_t  Cond;
+    bool            Signaled;
+} wakeup;
+
+void InitWakeup(wakeup* Wakeup);
+void FreeWakeup(wakeup* Wakeup);
+
+void SignalWakeup(wakeup* Wakeup);
+
+// Sleeps until signaled.
+void WaitWakeup(wakeup* Wakeup);
+
+// Sleeps until signaled or until TimeoutSeconds have passed.
+void TimedWaitWakeup(wakeup* Wakeup, double TimeoutSeconds);
+
+#endif // WAKEUP_H
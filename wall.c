@@ -0,0 +1,187 @@
+#include "wall.h"
+#include "quad.h"
+#include "texture.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+
+size_t GetWallLayerBytes(int LayerWidth, int LayerHeight, bool Mipmapped) {
+    // Three full size single channel planes, and a third more for mips
+    size_t Bytes = (size_t)LayerWidth * LayerHeight * 3;
+    return Mipmapped ? Bytes + Bytes / 3 : Bytes;
+}
+
+wall* CreateWall(GLuint Program, int MaxTiles, int LayerWidth, int LayerHeight,
+    int CacheLayers, int CacheLayerWidth, int CacheLayerHeight, bool Mipmapped)
+{
+    wall* Wall = calloc(1, sizeof(wall));
+
+    Wall->Program      = Program;
+    Wall->TexYLocation = glGetUniformLocation(Program, "uTexY");
+    Wall->TexULocation = glGetUniformLocation(Program, "uTexU");
+    Wall->TexVLocation = glGetUniformLocation(Program, "uTexV");
+    Wall->CacheYLocation = glGetUniformLocation(Program, "uCacheY");
+    Wall->CacheULocation = glGetUniformLocation(Program, "uCacheU");
+    Wall->CacheVLocation = glGetUniformLocation(Program, "uCacheV");
+
+    Wall->MaxTiles    = MaxTiles;
+    Wall->Tiles       = calloc(MaxTiles, sizeof(wall_tile));
+    Wall->Instances   = calloc(MaxTiles, sizeof(wall_instance));
+    Wall->LayerWidth  = LayerWidth;
+    Wall->LayerHeight = LayerHeight;
+    Wall->Levels      = Mipmapped ? GetMipLevelCount(LayerWidth, LayerHeight) : 1;
+
+    for (int Plane = 0; Plane < 3; Plane++) {
+        Wall->PlaneTextures[Plane] = CreateTextureArray(
+            LayerWidth, LayerHeight, MaxTiles, 1, Wall->Levels);
+    }
+
+    GLint MaxLayers;
+    glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &MaxLayers);
+    if (CacheLayerWidth > 0 && CacheLayerHeight > 0) {
+        Wall->CacheLayers = MAX(0, MIN(CacheLayers, MaxLayers));
+    }
+    if (Wall->CacheLayers > 0) {
+        Wall->CacheLayerWidth  = CacheLayerWidth;
+        Wall->CacheLayerHeight = CacheLayerHeight;
+        Wall->CacheLevels      = Mipmapped ? GetMipLevelCount(CacheLayerWidth, CacheLayerHeight) : 1;
+        for (int Plane = 0; Plane < 3; Plane++) {
+            Wall->CacheTextures[Plane] = CreateTextureArray(
+                CacheLayerWidth, CacheLayerHeight, Wall->CacheLayers, 1, Wall->CacheLevels);
+        }
+    }
+
+    // Every instance is the unit quad, stretched to its tile's rect
+    const float UnitQuad[8] = {
+        0, 0,  // Left Top
+        0, 1,  // Left Bottom
+        1, 0,  // Right Top
+        1, 1   // Right Bottom
+    };
+    Wall->QuadVAO = CreateQuad(UnitQuad);
+
+    glGenBuffers(1, &Wall->InstanceBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, Wall->InstanceBuffer);
+    glBufferData(GL_ARRAY_BUFFER, MaxTiles * sizeof(wall_instance), NULL, GL_DYNAMIC_DRAW);
+
+    const GLuint RectAttrIndex    = 2; // layout(location = 2) in vert shader
+    const GLuint UVScaleAttrIndex = 3; // layout(location = 3) in vert shader
+    const GLuint ParamsAttrIndex  = 4; // layout(location = 4) in vert shader
+    const GLuint CachedAttrIndex  = 5; // layout(location = 5) in vert shader
+    glVertexAttribPointer(RectAttrIndex, 4, GL_FLOAT, GL_FALSE,
+        sizeof(wall_instance), (void*)offsetof(wall_instance, Rect));
+    glVertexAttribPointer(UVScaleAttrIndex, 4, GL_FLOAT, GL_FALSE,
+        sizeof(wall_instance), (void*)offsetof(wall_instance, UVScale));
+    glVertexAttribPointer(ParamsAttrIndex, 4, GL_FLOAT, GL_FALSE,
+        sizeof(wall_instance), (void*)offsetof(wall_instance, Params));
+    glVertexAttribPointer(CachedAttrIndex, 1, GL_FLOAT, GL_FALSE,
+        sizeof(wall_instance), (void*)offsetof(wall_instance, Cached));
+    glEnableVertexAttribArray(RectAttrIndex);
+    glEnableVertexAttribArray(UVScaleAttrIndex);
+    glEnableVertexAttribArray(ParamsAttrIndex);
+    glEnableVertexAttribArray(CachedAttrIndex);
+    glVertexAttribDivisor(RectAttrIndex, 1);
+    glVertexAttribDivisor(UVScaleAttrIndex, 1);
+    glVertexAttribDivisor(ParamsAttrIndex, 1);
+    glVertexAttribDivisor(CachedAttrIndex, 1);
+
+    glBindVertexArray(0);
+
+    return Wall;
+}
+
+bool AddVideoToWall(wall* Wall, video* Video, float X0, float Y0, float X1, float Y1) {
+    if (!Video || Wall->NumTiles >= Wall->MaxTiles) return false;
+
+    const int Layer = Wall->NumTiles;
+    bool Shared = ShareVideoPlaneTextures(Video, Wall->PlaneTextures, Layer,
+        Wall->LayerWidth, Wall->LayerHeight, Wall->Levels);
+    if (!Shared) return false;
+
+    int CacheFrames = GetVideoCacheFrames(Video);
+    if (CacheFrames > 0 && Wall->NextCacheLayer + CacheFrames <= Wall->CacheLayers) {
+        CacheVideoFrames(Video, Wall->CacheTextures, Wall->NextCacheLayer, CacheFrames,
+            Wall->CacheLayerWidth, Wall->CacheLayerHeight, Wall->CacheLevels);
+        Wall->NextCacheLayer += CacheFrames;
+    }
+
+    wall_tile* Tile = &Wall->Tiles[Layer];
+    Tile->Video = Video;
+    Tile->Rect[0] = X0;
+    Tile->Rect[1] = Y0;
+    Tile->Rect[2] = X1;
+    Tile->Rect[3] = Y1;
+
+    Wall->NumTiles++;
+    Wall->InstancesUploaded = false;
+    return true;
+}
+
+void UpdateWallInstance(wall* Wall, int TileIndex, wall_instance* Instance) {
+    wall_tile* Tile = &Wall->Tiles[TileIndex];
+    video* Video = Tile->Video;
+
+    memcpy(Instance->Rect, Tile->Rect, sizeof(Instance->Rect));
+    Instance->UVScale[0] = (float)Video->OutputWidth        / Video->LumaLayerWidth;
+    Instance->UVScale[1] = (float)Video->OutputHeight       / Video->LumaLayerHeight;
+    Instance->UVScale[2] = (float)Video->OutputChromaWidth  / Video->ChromaLayerWidth;
+    Instance->UVScale[3] = (float)Video->OutputChromaHeight / Video->ChromaLayerHeight;
+    Instance->Params[0]  = Video->PlaneLayer;
+    Instance->Params[1]  = Video->ColorMatrix;
+    Instance->Params[2]  = Video->FullRange;
+    Instance->Params[3]  = Video->UsingMipmaps;
+    Instance->Cached     = Wall->CacheLayers > 0 &&
+        Video->PlaneTextures[0] == Wall->CacheTextures[0];
+}
+
+void DrawWall(wall* Wall) {
+    if (Wall->NumTiles == 0) return;
+
+    // Instance data only changes when a video's format or filtering does,
+    // or a cached clip moves on to another layer
+    bool InstancesChanged = !Wall->InstancesUploaded;
+    for (int TileIndex = 0; TileIndex < Wall->NumTiles; TileIndex++) {
+        wall_instance Instance;
+        UpdateWallInstance(Wall, TileIndex, &Instance);
+        if (memcmp(&Instance, &Wall->Instances[TileIndex], sizeof(Instance))) {
+            Wall->Instances[TileIndex] = Instance;
+            InstancesChanged = true;
+        }
+    }
+    if (InstancesChanged) {
+        glBindBuffer(GL_ARRAY_BUFFER, Wall->InstanceBuffer);
+        glBufferSubData(GL_ARRAY_BUFFER, 0,
+            Wall->NumTiles * sizeof(wall_instance), Wall->Instances);
+        Wall->InstancesUploaded = true;
+    }
+
+    glUseProgram(Wall->Program);
+    glUniform1i(Wall->TexYLocation, 0);
+    glUniform1i(Wall->TexULocation, 1);
+    glUniform1i(Wall->TexVLocation, 2);
+    glUniform1i(Wall->CacheYLocation, 3);
+    glUniform1i(Wall->CacheULocation, 4);
+    glUniform1i(Wall->CacheVLocation, 5);
+
+    for (int Plane = 0; Plane < 3; Plane++) {
+        glActiveTexture(GL_TEXTURE0 + Plane);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, Wall->PlaneTextures[Plane]);
+        glActiveTexture(GL_TEXTURE3 + Plane);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, Wall->CacheTextures[Plane]);
+    }
+
+    glBindVertexArray(Wall->QuadVAO);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, Wall->NumTiles);
+}
+
+void FreeWall(wall* Wall) {
+    if (!Wall) return;
+
+    glDeleteTextures(3, Wall->PlaneTextures);
+    glDeleteTextures(3, Wall->CacheTextures);
+    glDeleteBuffers(1, &Wall->InstanceBuffer);
+    glDeleteVertexArrays(1, &Wall->QuadVAO);
+    free(Wall->Tiles);
+    free(Wall->Instances);
+    free(Wall);
+}
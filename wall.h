@@ -0,0 +1,87 @@
+#ifndef WALL_H
+#define WALL_H
+
+#include <GL/glew.h>
+#include "video.h"
+
+// Draws a grid of videos with a single instanced draw call.
+// Every tile's planes live in one layer of the wall's shared
+// texture arrays, and each tile's rect, UV scale and color
+// parameters live in one instance buffer.
+// Texture arrays of their own hold the frame caches of short clips,
+// which play by changing the layer their tile samples. Their layers
+// are only as big as the clips' reduced pictures.
+
+// Default size of the layers set aside for frame caches
+#define WALL_CACHE_BUDGET_BYTES ((size_t)256 << 20)
+
+// Must match the per-instance attributes in quad.vert
+typedef struct {
+    float Rect[4];     // Clip space x0, y0, x1, y1
+    float UVScale[4];  // Part of the layer the video fills: luma xy, chroma zw
+    float Params[4];   // Layer, color matrix, full range, use mipmaps
+    float Cached;      // Layer is in the cache textures
+} wall_instance;
+
+typedef struct {
+    video* Video;
+    float  Rect[4];
+} wall_tile;
+
+typedef struct {
+    GLuint Program;
+    GLint  TexYLocation;
+    GLint  TexULocation;
+    GLint  TexVLocation;
+
+    GLuint QuadVAO;
+    GLuint InstanceBuffer;
+
+    // GL_TEXTURE_2D_ARRAYs of Y, U and V, one layer per tile.
+    // Chroma layers are full size so 4:4:4 videos fit.
+    GLuint PlaneTextures[3];
+    int    LayerWidth;
+    int    LayerHeight;
+    int    Levels;
+
+    // The same, one layer per cached frame
+    GLint  CacheYLocation;
+    GLint  CacheULocation;
+    GLint  CacheVLocation;
+    GLuint CacheTextures[3];
+    int    CacheLayerWidth;
+    int    CacheLayerHeight;
+    int    CacheLevels;
+    int    CacheLayers;
+    int    NextCacheLayer;
+
+    int        MaxTiles;
+    int        NumTiles;
+    wall_tile* Tiles;
+    wall_instance* Instances;
+    bool       InstancesUploaded;
+} wall;
+
+// Bytes of texture memory each layer of such a wall takes.
+size_t GetWallLayerBytes(int LayerWidth, int LayerHeight, bool Mipmapped);
+
+// Videos up to LayerWidth x LayerHeight can be added.
+// CacheLayers layers of CacheLayerWidth x CacheLayerHeight are shared
+// out between the frame caches of videos short enough to fit, in the
+// order they're added. Size them with GetVideoCacheFrameSize.
+wall* CreateWall(GLuint Program, int MaxTiles, int LayerWidth, int LayerHeight,
+    int CacheLayers, int CacheLayerWidth, int CacheLayerHeight, bool Mipmapped);
+
+// Moves the video's planes into the wall and places it at the given
+// clip space rect, caching its frames if there are layers left for
+// them. Returns false if the wall is full or the video is bigger
+// than a layer.
+bool AddVideoToWall(wall* Wall, video* Video, float X0, float Y0, float X1, float Y1);
+
+// Draws every tile. Call after ticking the wall's videos.
+void DrawWall(wall* Wall);
+
+// Doesn't free the videos.
+void FreeWall(wall* Wall);
+
+#endif // WALL_H